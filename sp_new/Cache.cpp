@@ -0,0 +1,290 @@
+#include "Cache.hpp"
+
+#include <cstring>
+
+void ClusterCache::init(Disk& disk, uint dataStartAddress, uint clusterSize) {
+    mDisk = &disk;
+    mDataStartAddress = dataStartAddress;
+    mClusterSize = clusterSize;
+    ClusterCache::clear();
+}
+
+ClusterCache::Entry& ClusterCache::insert(uint cluster) {
+    if (mLru.size() >= ClusterCache::max_clusters()) {
+        // recycle the least recently used entry together with its buffer
+        mIndex.erase(mLru.back().cluster);
+        mLru.splice(mLru.begin(), mLru, std::prev(mLru.end()));
+    }
+    else mLru.push_front(Entry{0, std::vector<char>(mClusterSize)});
+
+    mLru.front().cluster = cluster;
+    mIndex[cluster] = mLru.begin();
+    return mLru.front();
+}
+
+void ClusterCache::shrink_to(size_t capacity) {
+    while (mLru.size() > capacity) {
+        mIndex.erase(mLru.back().cluster);
+        mLru.pop_back();
+    }
+}
+
+std::span<const char> ClusterCache::read(uint cluster) {
+    auto it = mIndex.find(cluster);
+    if (it != mIndex.end()) {
+        mHits++;
+        mLru.splice(mLru.begin(), mLru, it->second);
+        return mLru.front().data;
+    }
+
+    mMisses++;
+    Entry& entry = ClusterCache::insert(cluster);
+    mDisk->read_at(ClusterCache::address(cluster), entry.data.data(), mClusterSize);
+    return entry.data;
+}
+
+void ClusterCache::write(uint cluster, uint offset, const char* data, size_t size) {
+    if (offset > mClusterSize || size > mClusterSize - offset)
+        throw std::out_of_range("Write outside of a cluster");
+
+    mDisk->write_at(ClusterCache::address(cluster) + offset, data, size);
+
+    auto it = mIndex.find(cluster);
+    if (it != mIndex.end()) {
+        mLru.splice(mLru.begin(), mLru, it->second);
+        std::memcpy(mLru.front().data.data() + offset, data, size);
+    }
+    else if (offset == 0 && size == mClusterSize) {
+        // whole cluster is known, no need to read it from disk later
+        Entry& entry = ClusterCache::insert(cluster);
+        std::memcpy(entry.data.data(), data, size);
+    }
+}
+
+void ClusterCache::read_run(Range run, char* data) {
+    bool allCached = true;
+    for (uint cluster = run.lower; cluster <= run.upper && allCached; ++cluster) {
+        allCached = mIndex.contains(cluster);
+    }
+
+    // a fully cached run needs no disk access at all
+    if (!allCached) {
+        size_t size = static_cast<size_t>(run.upper - run.lower + 1) * mClusterSize;
+        mDisk->read_at(ClusterCache::address(run.lower), data, size);
+    }
+
+    Utils::with_cluster_size(mClusterSize, [&](auto clusterSize) {
+        for (uint cluster = run.lower; cluster <= run.upper; ++cluster) {
+            auto it = mIndex.find(cluster);
+            if (it != mIndex.end())
+                std::memcpy(data + static_cast<size_t>(cluster - run.lower) * clusterSize, it->second->data.data(), clusterSize);
+        }
+    });
+}
+
+void ClusterCache::write_run(Range run, const char* data, size_t size) {
+    mDisk->write_at(ClusterCache::address(run.lower), data, size);
+
+    Utils::with_cluster_size(mClusterSize, [&](auto clusterSize) {
+        for (uint cluster = run.lower; cluster <= run.upper; ++cluster) {
+            auto it = mIndex.find(cluster);
+            if (it == mIndex.end()) continue;
+
+            size_t offset = static_cast<size_t>(cluster - run.lower) * clusterSize;
+            if (offset >= size) break;
+            if (size - offset >= clusterSize) std::memcpy(it->second->data.data(), data + offset, clusterSize);
+            else std::memcpy(it->second->data.data(), data + offset, size - offset);
+        }
+    });
+}
+
+void ClusterCache::set_capacity(size_t capacity) {
+    mCapacity = capacity;
+    ClusterCache::shrink_to(ClusterCache::max_clusters());
+}
+
+void ClusterCache::clear() {
+    mLru.clear();
+    mIndex.clear();
+    mHits = 0;
+    mMisses = 0;
+}
+
+WriteBackCache::~WriteBackCache() {
+    WriteBackCache::stop();
+}
+
+void WriteBackCache::attach(Disk& disk, size_t dataStartAddress, uint clusterSize) {
+    WriteBackCache::stop();
+    mDisk = &disk;
+    mDataStartAddress = dataStartAddress;
+    mClusterSize = clusterSize;
+    mMaxDirty = std::max<size_t>(MAX_DIRTY_SIZE / clusterSize, 1);
+    mDirty.clear();
+    mFlushing.clear();
+    mStop = false;
+    mFlusher = std::thread(&WriteBackCache::run, this);
+}
+
+void WriteBackCache::stop() {
+    if (!mFlusher.joinable()) return;
+    {
+        std::lock_guard lock(mMutex);
+        mStop = true;
+    }
+    mWake.notify_one();
+    mFlusher.join();
+}
+
+void WriteBackCache::set_policy(FlushPolicy policy, std::chrono::milliseconds interval) {
+    {
+        std::lock_guard lock(mMutex);
+        mPolicy = policy;
+        mInterval = interval;
+        mPolicyChanged = true;
+    }
+    mWake.notify_one();
+}
+
+void WriteBackCache::end_command() {
+    std::unique_lock lock(mMutex);
+    if (mPolicy == FlushPolicy::COMMAND) WriteBackCache::write_dirty(lock);
+}
+
+size_t WriteBackCache::dirty_count() {
+    std::lock_guard lock(mMutex);
+    return mDirty.size() + mFlushing.size();
+}
+
+void WriteBackCache::run() {
+    std::unique_lock lock(mMutex);
+    auto woken = [this] { return mStop || mPolicyChanged || mDirty.size() * 2 >= mMaxDirty; };
+    while (true) {
+        if (mPolicy == FlushPolicy::INTERVAL) mWake.wait_for(lock, mInterval, woken);
+        else mWake.wait(lock, woken);
+        mPolicyChanged = false;
+        if (mDirty.empty()) {
+            if (mStop) break;
+            continue;
+        }
+
+        // dirty clusters stay readable as mFlushing while they are written without holding the lock
+        mFlushing = std::move(mDirty);
+        mDirty.clear();
+        lock.unlock();
+
+        WriteBackCache::write_clusters(mFlushing);
+        {
+            std::lock_guard disk(mDiskMutex);
+            mDisk->flush();
+        }
+
+        lock.lock();
+        mFlushing.clear();
+        mIdle.notify_all();
+    }
+}
+
+void WriteBackCache::write_clusters(const std::map<uint, std::vector<char>>& clusters) {
+    std::vector<char> run{};
+    auto it = clusters.begin();
+    while (it != clusters.end()) {
+        // adjacent clusters are written at once
+        uint first = it->first, length = 0;
+        run.clear();
+        while (it != clusters.end() && it->first == first + length) {
+            run.insert(run.end(), it->second.begin(), it->second.end());
+            ++it;
+            ++length;
+        }
+        std::lock_guard disk(mDiskMutex);
+        mDisk->write_at(WriteBackCache::address(first), run.data(), run.size());
+    }
+}
+
+void WriteBackCache::write_dirty(std::unique_lock<std::mutex>& lock) {
+    // clusters taken by the flusher have to reach the disk before newer ones
+    mIdle.wait(lock, [this] { return mFlushing.empty(); });
+    auto clusters = std::move(mDirty);
+    mDirty.clear();
+    WriteBackCache::write_clusters(clusters);
+}
+
+void WriteBackCache::read_at(size_t offset, char* data, size_t size) {
+    std::lock_guard lock(mMutex);
+    {
+        std::lock_guard disk(mDiskMutex);
+        mDisk->read_at(offset, data, size);
+    }
+
+    size_t end = offset + size;
+    if (size == 0 || end <= mDataStartAddress) return;
+    uint first = (std::max(offset, mDataStartAddress) - mDataStartAddress) / mClusterSize;
+    uint last = (end - 1 - mDataStartAddress) / mClusterSize;
+
+    // clusters being flushed are older than dirty ones, both are newer than the disk image
+    for (const auto* clusters : {&mFlushing, &mDirty}) {
+        for (auto it = clusters->lower_bound(first); it != clusters->end() && it->first <= last; ++it) {
+            size_t clusterStart = WriteBackCache::address(it->first);
+            size_t from = std::max(offset, clusterStart), to = std::min(end, clusterStart + mClusterSize);
+            std::memcpy(data + (from - offset), it->second.data() + (from - clusterStart), to - from);
+        }
+    }
+}
+
+void WriteBackCache::write_at(size_t offset, const char* data, size_t size) {
+    if (size == 0) return;
+    std::unique_lock lock(mMutex);
+
+    // everything before data blocks is written through
+    if (offset < mDataStartAddress) {
+        size_t count = std::min(size, mDataStartAddress - offset);
+        {
+            std::lock_guard disk(mDiskMutex);
+            mDisk->write_at(offset, data, count);
+        }
+        offset += count;
+        data += count;
+        size -= count;
+        if (size == 0) return;
+    }
+
+    size_t end = offset + size;
+    uint first = (offset - mDataStartAddress) / mClusterSize;
+    uint last = (end - 1 - mDataStartAddress) / mClusterSize;
+    size_t count = last - first + 1;
+    if (mDirty.size() + count > mMaxDirty) {
+        WriteBackCache::write_dirty(lock);
+        if (count > mMaxDirty) {    // does not fit at all, nothing newer is left in memory
+            std::lock_guard disk(mDiskMutex);
+            mDisk->write_at(offset, data, size);
+            return;
+        }
+    }
+
+    for (uint cluster = first; cluster <= last; ++cluster) {
+        size_t clusterStart = WriteBackCache::address(cluster);
+        size_t from = std::max(offset, clusterStart), to = std::min(end, clusterStart + mClusterSize);
+
+        // partially written clusters start as their newest content
+        auto [it, inserted] = mDirty.try_emplace(cluster);
+        if (inserted) {
+            it->second.resize(mClusterSize);
+            auto flushing = mFlushing.find(cluster);
+            if (flushing != mFlushing.end()) it->second = flushing->second;
+            else if (to - from < mClusterSize) {
+                std::lock_guard disk(mDiskMutex);
+                mDisk->read_at(clusterStart, it->second.data(), mClusterSize);
+            }
+        }
+        std::memcpy(it->second.data() + (from - clusterStart), data + (from - offset), to - from);
+    }
+    if (mDirty.size() * 2 >= mMaxDirty) mWake.notify_one();
+}
+
+void WriteBackCache::flush() {
+    std::unique_lock lock(mMutex);
+    WriteBackCache::write_dirty(lock);
+    std::lock_guard disk(mDiskMutex);
+    mDisk->flush();
+}
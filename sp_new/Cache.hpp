@@ -0,0 +1,229 @@
+#pragma once
+
+#include <map>
+#include <list>
+#include <span>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <condition_variable>
+#include "Disk.hpp"
+#include "Utils.hpp"
+
+/**
+ * Class ClusterCache - fixed capacity LRU cache of data clusters, keyed by cluster index.
+ * The capacity is given in bytes, so the cache takes the same memory whatever the cluster size is.
+ * Writes go through to the disk, so an evicted cluster never needs to be written back.
+ */
+class ClusterCache {
+    public:
+        static constexpr size_t DEFAULT_CAPACITY = 4_MB;   // in bytes
+
+    private:
+        /**
+         * Structure Entry - one cached cluster.
+         */
+        struct Entry {
+            uint cluster;
+            std::vector<char> data;
+        };
+
+        Disk* mDisk;
+        uint mDataStartAddress;
+        uint mClusterSize;
+        size_t mCapacity;           // in bytes
+        size_t mHits;
+        size_t mMisses;
+        std::list<Entry> mLru;      // most recently used at the front
+        std::unordered_map<uint, std::list<Entry>::iterator> mIndex;
+
+        /**
+         * Method makes room for a new cluster and puts it at the front of the LRU list.
+         * The buffer of an evicted cluster is reused.
+         * @param cluster index of cluster to be inserted
+         * @return the inserted entry, its data are not initialized
+         */
+        Entry& insert(uint cluster);
+
+        /**
+         * Method returns the disk address of a cluster.
+         * @param cluster index of cluster
+         * @return address in disk image
+         */
+        [[nodiscard]] size_t address(uint cluster) const {
+            return mDataStartAddress + static_cast<size_t>(cluster) * mClusterSize;
+        }
+
+        /**
+         * Method evicts least recently used clusters until the cache fits its capacity.
+         * @param capacity to be fit into
+         */
+        void shrink_to(size_t capacity);
+
+        /**
+         * Method returns the capacity in clusters.
+         * @return number of clusters fitting into the capacity, at least one
+         */
+        [[nodiscard]] size_t max_clusters() const { return std::max<size_t>(mCapacity / mClusterSize, 1); }
+
+    public:
+        ClusterCache() : mDisk(nullptr), mDataStartAddress(0), mClusterSize(DEFAULT_CLUSTER_SIZE),
+                         mCapacity(DEFAULT_CAPACITY), mHits(0), mMisses(0) {}
+        ~ClusterCache() = default;
+
+        /**
+         * The de-facto constructor. Drops all cached clusters.
+         * @param disk to be cached
+         * @param dataStartAddress start address of data blocks
+         * @param clusterSize size of one cluster
+         */
+        void init(Disk& disk, uint dataStartAddress, uint clusterSize);
+
+        /**
+         * Method reads a whole cluster, from the cache if possible.
+         * @param cluster index of cluster
+         * @return view of cluster data, valid until the next call of the cache
+         */
+        std::span<const char> read(uint cluster);
+
+        /**
+         * Method writes data into a cluster. The disk is written immediately, a cached copy is updated.
+         * Writing a whole cluster also caches it.
+         * @param cluster index of cluster
+         * @param offset position inside of the cluster
+         * @param data to be written
+         * @param size number of bytes to be written
+         */
+        void write(uint cluster, uint offset, const char* data, size_t size);
+
+        /**
+         * Method reads a run of adjacent clusters with a single disk read, or none if all of them are cached.
+         * Cached copies take precedence, read clusters are not inserted into the cache.
+         * @param run of clusters, bounds inclusive
+         * @param data buffer of at least (run.upper - run.lower + 1) * cluster_size() bytes
+         */
+        void read_run(Range run, char* data);
+
+        /**
+         * Method writes a run of adjacent clusters with a single disk write. Cached copies are updated.
+         * @param run of clusters, bounds inclusive
+         * @param data to be written, starting at the beginning of the first cluster
+         * @param size number of bytes to be written, at most the size of the run
+         */
+        void write_run(Range run, const char* data, size_t size);
+
+        /**
+         * Method changes the capacity of the cache, evicting clusters if needed.
+         * @param capacity new capacity in bytes, at least one cluster is always kept
+         */
+        void set_capacity(size_t capacity);
+
+        /**
+         * Method drops all cached clusters and resets the counters.
+         */
+        void clear();
+
+        [[nodiscard]] uint cluster_size() const { return mClusterSize; }
+        [[nodiscard]] size_t capacity() const { return mCapacity; }
+        [[nodiscard]] size_t size() const { return mLru.size(); }   // in clusters
+        [[nodiscard]] size_t hits() const { return mHits; }
+        [[nodiscard]] size_t misses() const { return mMisses; }
+};
+
+/**
+ * Enum class FlushPolicy - when the write-back cache writes its dirty clusters to the disk.
+ */
+enum class FlushPolicy { COMMAND, INTERVAL, SYNC };
+
+/**
+ * Class WriteBackCache - write-back layer of data clusters, a Disk layered over the disk image.
+ *
+ * Writes into the data region are kept in memory as dirty clusters, other writes go straight to the disk.
+ * Dirty clusters are written by the caller at the end of every command (COMMAND), by a background thread
+ * every few milliseconds (INTERVAL), or only on flush() (SYNC). The background thread also starts writing
+ * once half of MAX_DIRTY_SIZE is dirty. flush() writes all of them, so a flush of the journal orders data
+ * before the metadata pointing to it.
+ */
+class WriteBackCache : public Disk {
+    public:
+        static constexpr size_t MAX_DIRTY_SIZE = 4_MB;      // above it, the writer writes dirty clusters itself
+
+    private:
+        Disk* mDisk = nullptr;
+        size_t mDataStartAddress = 0;
+        uint mClusterSize = DEFAULT_CLUSTER_SIZE;
+        size_t mMaxDirty = 1;                                   // in clusters
+        std::map<uint, std::vector<char>> mDirty;               // cluster index -> its newest content
+        std::map<uint, std::vector<char>> mFlushing;            // dirty clusters being written by the flusher
+        FlushPolicy mPolicy = FlushPolicy::COMMAND;
+        std::chrono::milliseconds mInterval{0};
+        bool mPolicyChanged = false;
+        bool mStop = false;
+        std::mutex mMutex;                                      // guards all of the above
+        std::mutex mDiskMutex;                                  // guards mDisk, locked after mMutex
+        std::condition_variable mWake;                          // too many dirty clusters, new policy or stop
+        std::condition_variable mIdle;                          // the flusher has written what it took
+        std::thread mFlusher;
+
+        /**
+         * Method of the background thread - writes dirty clusters according to the policy until stopped.
+         */
+        void run();
+
+        /**
+         * Method writes clusters to the disk, runs of adjacent clusters at once. mDiskMutex is locked inside.
+         * @param clusters cluster index -> content
+         */
+        void write_clusters(const std::map<uint, std::vector<char>>& clusters);
+
+        /**
+         * Method writes all dirty clusters by the calling thread. mMutex has to be locked.
+         * @param lock of mMutex
+         */
+        void write_dirty(std::unique_lock<std::mutex>& lock);
+
+        /**
+         * Method stops the background thread, the dirty clusters are written first.
+         */
+        void stop();
+
+        [[nodiscard]] size_t address(uint cluster) const {
+            return mDataStartAddress + static_cast<size_t>(cluster) * mClusterSize;
+        }
+
+    public:
+        WriteBackCache() = default;
+        ~WriteBackCache() override;
+
+        /**
+         * The de-facto constructor. Starts the background thread.
+         * @param disk disk image, all accesses go to it
+         * @param dataStartAddress start address of data blocks, only clusters are cached
+         * @param clusterSize size of one cluster
+         */
+        void attach(Disk& disk, size_t dataStartAddress, uint clusterSize);
+
+        /**
+         * Method sets when dirty clusters are written.
+         * @param policy see FlushPolicy
+         * @param interval period of INTERVAL policy
+         */
+        void set_policy(FlushPolicy policy, std::chrono::milliseconds interval = std::chrono::milliseconds{0});
+
+        /**
+         * Method finishes a command, dirty clusters are written under COMMAND policy.
+         */
+        void end_command();
+
+        [[nodiscard]] FlushPolicy policy() const { return mPolicy; }
+        [[nodiscard]] std::chrono::milliseconds interval() const { return mInterval; }
+        [[nodiscard]] size_t dirty_count();
+
+        bool create(const std::string& name, size_t size) override { return mDisk->create(name, size); }
+        bool open(const std::string& name) override { return mDisk->open(name); }
+        void read_at(size_t offset, char* data, size_t size) override;
+        void write_at(size_t offset, const char* data, size_t size) override;
+        void flush() override;
+};
@@ -0,0 +1,131 @@
+#include "Disk.hpp"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+std::unique_ptr<Disk> Disk::make(DiskBackend backend) {
+    if (backend == DiskBackend::MMAP) return std::make_unique<MappedDisk>();
+    return std::make_unique<StreamDisk>();
+}
+
+std::optional<DiskBackend> Disk::parse_backend(const std::string& name) {
+    if (name == "stream") return DiskBackend::STREAM;
+    if (name == "mmap") return DiskBackend::MMAP;
+    return std::nullopt;
+}
+
+// Start : StreamDisk
+StreamDisk::~StreamDisk() {
+    if (mStream.is_open()) StreamDisk::flush();
+    if (mSyncFd >= 0) ::close(mSyncFd);
+}
+
+bool StreamDisk::create(const std::string& name, [[maybe_unused]] size_t size) {
+    // the stream grows as it is written, no need to size it upfront
+    auto mode = std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc;
+    mStream.open(name, mode);
+    mStreamPos = 0;
+    if (!mStream.is_open()) return false;
+    mSyncFd = ::open(name.c_str(), O_RDWR);
+    return mSyncFd >= 0;
+}
+
+bool StreamDisk::open(const std::string& name) {
+    auto mode = std::ios::in | std::ios::out | std::ios::binary;
+    mStream.open(name, mode);
+    mStreamPos = 0;
+    if (!mStream.is_open()) return false;
+    mSyncFd = ::open(name.c_str(), O_RDWR);
+    return mSyncFd >= 0;
+}
+
+void StreamDisk::position(size_t offset, bool isWrite) {
+    if (offset != mStreamPos || isWrite != mLastWasWrite) {
+        mStream.clear();
+        if (isWrite) mStream.seekp(static_cast<std::streamoff>(offset));
+        else mStream.seekg(static_cast<std::streamoff>(offset));
+    }
+    mStreamPos = offset;
+    mLastWasWrite = isWrite;
+}
+
+void StreamDisk::read_at(size_t offset, char* data, size_t size) {
+    StreamDisk::position(offset, false);
+    mStream.read(data, static_cast<std::streamsize>(size));
+    mStreamPos += size;
+}
+
+void StreamDisk::write_at(size_t offset, const char* data, size_t size) {
+    StreamDisk::position(offset, true);
+    mStream.write(data, static_cast<std::streamsize>(size));
+    mStreamPos += size;
+}
+
+void StreamDisk::flush() {
+    // the write-ahead order of the journal holds only once the data is on the device
+    mStream.flush();
+    if (mSyncFd >= 0) fsync(mSyncFd);
+}
+// End : StreamDisk
+
+// Start : MappedDisk
+MappedDisk::~MappedDisk() {
+    if (mData != nullptr) {
+        MappedDisk::flush();
+        munmap(mData, mSize);
+    }
+    if (mFd >= 0) close(mFd);
+}
+
+bool MappedDisk::create(const std::string& name, size_t size) {
+    mFd = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (mFd < 0) return false;
+    if (ftruncate(mFd, static_cast<off_t>(size)) != 0) return false;
+
+    mSize = size;
+    return MappedDisk::map();
+}
+
+bool MappedDisk::open(const std::string& name) {
+    mFd = ::open(name.c_str(), O_RDWR);
+    if (mFd < 0) return false;
+
+    struct stat st{};
+    if (fstat(mFd, &st) != 0) return false;
+
+    mSize = static_cast<size_t>(st.st_size);
+    return MappedDisk::map();
+}
+
+bool MappedDisk::map() {
+    if (mSize == 0) return false;
+
+    void* addr = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (addr == MAP_FAILED) return false;
+
+    mData = static_cast<char *>(addr);
+    return true;
+}
+
+void MappedDisk::check_bounds(size_t offset, size_t size) const {
+    if (offset > mSize || size > mSize - offset)
+        throw std::out_of_range("Access outside of the mapped disk image");
+}
+
+void MappedDisk::read_at(size_t offset, char* data, size_t size) {
+    MappedDisk::check_bounds(offset, size);
+    std::memcpy(data, mData + offset, size);
+}
+
+void MappedDisk::write_at(size_t offset, const char* data, size_t size) {
+    MappedDisk::check_bounds(offset, size);
+    std::memcpy(mData + offset, data, size);
+}
+
+void MappedDisk::flush() {
+    msync(mData, mSize, MS_SYNC);
+}
+// End : MappedDisk
\ No newline at end of file
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <memory>
+#include <fstream>
+#include <optional>
+#include "Utils.hpp"
+
+/**
+ * Enum class DiskBackend - the way the disk image is accessed.
+ */
+enum class DiskBackend { STREAM, MMAP };
+
+/**
+ * Class Disk - abstraction of a disk image. Besides positional access, it keeps a cursor
+ * so it can be used in place of a stream by the Utils stream methods.
+ */
+class Disk {
+    protected:
+        size_t mPos = 0;    // cursor used by seek(), read() and write()
+
+    public:
+        Disk() = default;
+        virtual ~Disk() = default;
+
+        /**
+         * Method creates a new disk image, overwriting an existing one.
+         * @param name of the disk image
+         * @param size of the disk image in bytes
+         * @return true on success, else false
+         */
+        virtual bool create(const std::string& name, size_t size) = 0;
+
+        /**
+         * Method opens an existing disk image.
+         * @param name of the disk image
+         * @return true on success, else false
+         */
+        virtual bool open(const std::string& name) = 0;
+
+        /**
+         * Method reads data from a given position of the disk image.
+         * @param offset position in disk image
+         * @param data buffer to be read into
+         * @param size number of bytes to be read
+         */
+        virtual void read_at(size_t offset, char* data, size_t size) = 0;
+
+        /**
+         * Method writes data to a given position of the disk image.
+         * @param offset position in disk image
+         * @param data buffer to be written
+         * @param size number of bytes to be written
+         */
+        virtual void write_at(size_t offset, const char* data, size_t size) = 0;
+
+        /**
+         * Method makes all written data persistent.
+         */
+        virtual void flush() = 0;
+
+        void seek(size_t pos) { mPos = pos; }
+        [[nodiscard]] size_t tell() const { return mPos; }
+
+        void read(char* data, size_t size) {
+            read_at(mPos, data, size);
+            mPos += size;
+        }
+
+        void write(const char* data, size_t size) {
+            write_at(mPos, data, size);
+            mPos += size;
+        }
+
+        /**
+         * Factory method creating a disk of a given backend.
+         * @param backend type of disk
+         * @return newly created disk
+         */
+        static std::unique_ptr<Disk> make(DiskBackend backend);
+
+        /**
+         * Method parses a backend name.
+         * @param name "stream" or "mmap"
+         * @return parsed backend or std::nullopt
+         */
+        static std::optional<DiskBackend> parse_backend(const std::string& name);
+};
+
+/**
+ * Class StreamDisk - disk image accessed through std::fstream. std::fstream cannot sync the file,
+ * so flush() syncs it through a file descriptor of its own.
+ */
+class StreamDisk : public Disk {
+    private:
+        std::fstream mStream;
+        size_t mStreamPos = 0;      // position of the underlying stream, to avoid redundant seeks
+        bool mLastWasWrite = false; // switching between reading and writing requires a seek
+        int mSyncFd = -1;           // descriptor of the same file, used by flush() only
+
+        /**
+         * Method moves the underlying stream to offset, but only when needed.
+         * @param offset position in disk image
+         * @param isWrite true if the following operation is a write
+         */
+        void position(size_t offset, bool isWrite);
+
+    public:
+        StreamDisk() = default;
+        ~StreamDisk() override;
+
+        bool create(const std::string& name, size_t size) override;
+        bool open(const std::string& name) override;
+        void read_at(size_t offset, char* data, size_t size) override;
+        void write_at(size_t offset, const char* data, size_t size) override;
+        void flush() override;
+};
+
+/**
+ * Class MappedDisk - disk image mapped into memory, read and written as plain memory.
+ */
+class MappedDisk : public Disk {
+    private:
+        int mFd = -1;
+        char* mData = nullptr;
+        size_t mSize = 0;
+
+        /**
+         * Method maps the opened file into memory.
+         * @return true on success, else false
+         */
+        bool map();
+
+        /**
+         * Method checks that an access stays inside of the mapping.
+         * @param offset position in disk image
+         * @param size number of bytes accessed
+         */
+        void check_bounds(size_t offset, size_t size) const;
+
+    public:
+        MappedDisk() = default;
+        ~MappedDisk() override;
+
+        bool create(const std::string& name, size_t size) override;
+        bool open(const std::string& name) override;
+        void read_at(size_t offset, char* data, size_t size) override;
+        void write_at(size_t offset, const char* data, size_t size) override;
+        void flush() override;
+};
\ No newline at end of file
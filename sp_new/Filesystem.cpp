@@ -1,65 +1,130 @@
-#include <ranges>
+#include <bit>
+#include <cstring>
+#include <numeric>
+#include <utility>
 #include "Filesystem.hpp"
 
 // Start : BootSector
-void BootSector::init(uint diskSize) {
+void BootSector::init(uint diskSize, uint clusterSize, bool fatMirror) {
     mSignature = Utils::zero_padded_string("duclong", SIGNATURE_LEN);
     mDiskSize = diskSize;
-    mClusterSize = CLUSTER_SIZE;
-    mClusterCount = (mDiskSize - BootSector::SIZE()) / (CLUSTER_SIZE + sizeof(uint));
+    mClusterSize = clusterSize;
+    mClusterCount = (mDiskSize - BootSector::SIZE()) / (mClusterSize + sizeof(uint));
     mFatStartAddress = BootSector::SIZE();
     mDataStartAddress = BootSector::SIZE() + mClusterCount * sizeof(uint);
 
-    DirEntry tmp;
-    mMaxDirEntries = (CLUSTER_SIZE - sizeof(uint)) / tmp.SIZE();
+    // FAT2 and journal region sit between FAT and data blocks, all aligned to journal blocks
+    uint journalSize = Journal::size_for(diskSize);
+    uint fatCount = fatMirror ? 2 : 1;
+    if (journalSize > 0 || fatMirror) {
+        uint reserved = BootSector::SIZE() + journalSize + fatCount * Journal::BLOCK_SIZE;   // room for alignment
+        if (mDiskSize < reserved + mClusterSize + fatCount * sizeof(uint))
+            throw std::runtime_error("Disk is too small for a second FAT");
+
+        mClusterCount = (mDiskSize - reserved) / (mClusterSize + fatCount * sizeof(uint));
+        uint fatSpan = fatMirror ? align_block(mClusterCount * sizeof(uint)) : 0;
+        mDataStartAddress = align_block(mFatStartAddress + mClusterCount * sizeof(uint)) + fatSpan + journalSize;
+    }
+
+    mMaxDirEntries = (mClusterSize - sizeof(uint)) / DirEntry::SIZE();
     if (mMaxDirEntries == 0)
         throw std::runtime_error("Cluster size is too small. Try increasing it");
 }
 
-void BootSector::mount(std::fstream& stream) {
-    mSignature = Utils::string_from_stream(stream, SIGNATURE_LEN);
-    mDiskSize = Utils::read_from_stream<uint>(stream);
-    mClusterSize = Utils::read_from_stream<uint>(stream);
-    mClusterCount = Utils::read_from_stream<uint>(stream);
-    mFatStartAddress = Utils::read_from_stream<uint>(stream);
-    mDataStartAddress = Utils::read_from_stream<uint>(stream);
-    mMaxDirEntries = Utils::read_from_stream<uint>(stream);
+void BootSector::mount(Disk& stream) {
+    std::array<char, Layout::SIZE> data{};
+    stream.read(data.data(), data.size());
+    Layout::decode(*this, data.data());
 }
 
-void BootSector::write_to_disk(std::fstream &stream) {
-    Utils::string_to_stream(stream, mSignature);
-    Utils::write_to_stream(stream, mDiskSize, mClusterSize,mClusterCount,
-                           mFatStartAddress, mDataStartAddress, mMaxDirEntries);
+void BootSector::write_to_disk(Disk &stream) {
+    std::array<char, Layout::SIZE> data{};
+    Layout::encode(*this, data.data());
+    stream.write(data.data(), data.size());
 }
 // End : BootSector
 
 // Start : FAT
-void FAT::init(uint fatEntryCount) {
+void FAT::init(uint fatEntryCount, uint clusterSize) {
+    mClusterSize = clusterSize;
     table.resize(fatEntryCount, FAT::FLAG_UNUSED);
+    mDirtyPages.assign((fatEntryCount + PAGE_ENTRIES - 1) / PAGE_ENTRIES, true);
+    FAT::rebuild_free_bitmap();
+}
+
+void FAT::mount(Disk& stream) {
+    stream.read(reinterpret_cast<char *>(table.data()), FAT::SIZE());
+    std::fill(mDirtyPages.begin(), mDirtyPages.end(), false);
+    FAT::rebuild_free_bitmap();
 }
 
-void FAT::mount(std::fstream& stream) {
-    for (int& fatEntry : table) {
-        fatEntry = Utils::read_from_stream<int>(stream);
+void FAT::rebuild_free_bitmap() {
+    mFreeBitmap.assign((table.size() + 63) / 64, 0);
+    mFreeCount = 0;
+    mNextFit = 0;
+    mFreed.clear();
+    mReleasable.clear();
+
+    for (uint idx = 0; idx < table.size(); ++idx) {
+        if (table[idx] != FAT::FLAG_UNUSED) continue;
+        mFreeBitmap[idx / 64] |= uint64_t{1} << (idx % 64);
+        mFreeCount++;
+    }
+}
+
+void FAT::set_entry(uint idx, int value) {
+    bool wasFree = table[idx] == FAT::FLAG_UNUSED;
+    bool isFree = value == FAT::FLAG_UNUSED;
+    table[idx] = value;
+    mDirtyPages[idx / PAGE_ENTRIES] = true;
+
+    if (wasFree == isFree) return;
+    uint64_t bit = uint64_t{1} << (idx % 64);
+    if (isFree) {
+        mFreeBitmap[idx / 64] |= bit;
+        mFreeCount++;
+    }
+    else {
+        mFreeBitmap[idx / 64] &= ~bit;
+        mFreeCount--;
+        mNextFit = (idx + 1 < table.size()) ? idx + 1 : 0;
+    }
+}
+
+void FAT::free_entry(uint idx) {
+    table[idx] = FAT::FLAG_UNUSED;
+    mDirtyPages[idx / PAGE_ENTRIES] = true;
+    mFreed.push_back(idx);
+}
+
+std::vector<uint> FAT::take_releasable() {
+    return std::exchange(mReleasable, {});
+}
+
+void FAT::release(const std::vector<uint>& clusters) {
+    for (uint idx : clusters) {
+        mFreeBitmap[idx / 64] |= uint64_t{1} << (idx % 64);
+        mFreeCount++;
     }
 }
 
 bool FAT::write_FAT(uint idx, size_t fileSize) {
-    if (fileSize < CLUSTER_SIZE) {
-        table[idx] = FAT::FLAG_FILE_END;
+    if (fileSize < mClusterSize) {
+        FAT::set_entry(idx, FAT::FLAG_FILE_END);
         return true;
     }
     else {
-        int nextFreeCluster = find_free_index(idx);
-        while (fileSize > CLUSTER_SIZE) {
+        // claim the current cluster first, so it won't be found as free again
+        FAT::set_entry(idx, FAT::FLAG_FILE_END);
+        while (fileSize > mClusterSize) {
+            int nextFreeCluster = find_free_index(idx);
             if (nextFreeCluster == FAT::FLAG_NO_FREE_SPACE) return false;
 
-            table[idx] = nextFreeCluster;
+            FAT::set_entry(idx, nextFreeCluster);
+            FAT::set_entry(nextFreeCluster, FAT::FLAG_FILE_END);
             idx = nextFreeCluster;
-            nextFreeCluster = find_free_index(idx);
-            fileSize -= CLUSTER_SIZE;
+            fileSize -= mClusterSize;
         }
-        table[idx] = FAT::FLAG_FILE_END;
     }
     return true;
 }
@@ -67,25 +132,198 @@ bool FAT::write_FAT(uint idx, size_t fileSize) {
 void FAT::free_FAT(uint idx) {
     int nextCluster;
     do {
+        if (FAT::is_shared(idx)) {
+            // the rest of the chain is used by another file as well
+            for (int cluster = static_cast<int>(idx); cluster != FAT::FLAG_FILE_END; cluster = table[cluster]) {
+                FAT::drop_reference(cluster);
+            }
+            return;
+        }
         nextCluster = table[idx];
-        table[idx] = FAT::FLAG_UNUSED;
+        FAT::free_entry(idx);
         idx = nextCluster;
     } while (nextCluster != FLAG_FILE_END);
 }
 
+void FAT::share(uint idx) {
+    for (int cluster = static_cast<int>(idx); cluster != FAT::FLAG_FILE_END; cluster = table[cluster]) {
+        FAT::add_reference(cluster);
+    }
+}
+
+void FAT::drop_reference(uint idx) {
+    auto it = mShares.find(idx);
+    if (it != mShares.end() && --it->second == 0) mShares.erase(it);
+}
+
+int FAT::append(uint lastCluster) {
+    // the adjacent cluster keeps the chain in one run
+    uint next = lastCluster + 1;
+    int cluster = (next < table.size() && FAT::is_free(next)) ? static_cast<int>(next) : FAT::find_free_index(-1);
+    if (cluster == FAT::FLAG_NO_FREE_SPACE) return cluster;
+
+    FAT::set_entry(lastCluster, cluster);
+    FAT::set_entry(cluster, FAT::FLAG_FILE_END);
+    return cluster;
+}
+
+void FAT::truncate(uint lastCluster) {
+    int nextCluster = table[lastCluster];
+    if (nextCluster != FAT::FLAG_FILE_END) FAT::free_FAT(nextCluster);
+    FAT::set_entry(lastCluster, FAT::FLAG_FILE_END);
+}
+
 int FAT::find_free_index(int ignoredIdx) const {
-    // indexed range based for loop
-    for (int idx = 0; const auto& it : *this) {
-        if (it == FAT::FLAG_UNUSED && idx != ignoredIdx) return idx;
-        else ++idx;
+    if (mFreeBitmap.empty()) return FAT::FLAG_NO_FREE_SPACE;
+
+    // next-fit: scan whole words of the bitmap starting at the cursor, wrapping around once
+    size_t word = mNextFit / 64;
+    uint64_t mask = ~uint64_t{0} << (mNextFit % 64);
+    for (size_t i = 0; i <= mFreeBitmap.size(); ++i) {
+        uint64_t bits = mFreeBitmap[word] & mask;
+        if (ignoredIdx >= 0 && static_cast<size_t>(ignoredIdx) / 64 == word)
+            bits &= ~(uint64_t{1} << (ignoredIdx % 64));
+        if (bits != 0)
+            return static_cast<int>(word * 64 + std::countr_zero(bits));
+
+        mask = ~uint64_t{0};
+        word = (word + 1) % mFreeBitmap.size();
     }
     return FAT::FLAG_NO_FREE_SPACE;
 }
 
-void FAT::write_to_disk(std::fstream &stream) {
-    for (auto fatEntry : *this) {
-        Utils::write_to_stream(stream, fatEntry);
+void FAT::write_to_disk(Disk &stream) {
+    stream.write(reinterpret_cast<const char *>(table.data()), FAT::SIZE());
+    std::fill(mDirtyPages.begin(), mDirtyPages.end(), false);
+    mReleasable.insert(mReleasable.end(), mFreed.begin(), mFreed.end());
+    mFreed.clear();
+}
+
+void FAT::flush(Disk& stream, uint fatStartAddress, const FatRunConsumer& consumer) {
+    uint page = 0;
+    while (page < mDirtyPages.size()) {
+        if (!mDirtyPages[page]) {
+            page++;
+            continue;
+        }
+
+        // coalesce a run of adjacent dirty pages into one write
+        uint runStart = page;
+        while (page < mDirtyPages.size() && mDirtyPages[page]) {
+            mDirtyPages[page] = false;
+            page++;
+        }
+        uint firstEntry = runStart * PAGE_ENTRIES;
+        uint entryCount = std::min<uint>(page * PAGE_ENTRIES, table.size()) - firstEntry;
+
+        stream.seek(fatStartAddress + firstEntry * sizeof(int));
+        stream.write(reinterpret_cast<const char *>(&table[firstEntry]), entryCount * sizeof(int));
+        if (consumer) consumer(firstEntry, std::span<const int>{&table[firstEntry], entryCount});
+    }
+    mReleasable.insert(mReleasable.end(), mFreed.begin(), mFreed.end());
+    mFreed.clear();
+}
+
+void FAT::restore(const std::vector<int>& entries) {
+    table = entries;
+    std::fill(mDirtyPages.begin(), mDirtyPages.end(), true);
+    FAT::rebuild_free_bitmap();
+}
+
+bool FAT::is_valid(std::span<const int> entries) {
+    if (entries.empty() || entries.front() == FAT::FLAG_UNUSED) return false;
+    return std::all_of(entries.begin(), entries.end(), [&entries](int entry) {
+        return (entry >= FAT::FLAG_BAD_CLUSTER && entry <= FAT::FLAG_UNUSED) || (entry >= 0 && static_cast<size_t>(entry) < entries.size());
+    });
+}
+
+int FAT::allocate(size_t fileSize) {
+    uint clusterCount = FAT::cluster_count(fileSize);
+    if (clusterCount > mFreeCount) return FAT::FLAG_NO_FREE_SPACE;
+
+    if (mAllocationMode == AllocationMode::NEXT_FIT || clusterCount == 1) {
+        int startCluster = FAT::find_free_index(-1);
+        FAT::write_FAT(startCluster, fileSize);
+        return startCluster;
+    }
+
+    auto extents = FAT::free_extents();
+    auto length = [](const Range& range) { return range.upper - range.lower + 1; };
+
+    // best-fit: the smallest free extent the whole file fits into
+    auto bestFit = FAT::best_fit(extents, clusterCount);
+    if (bestFit) {
+        FAT::link_extents({bestFit.value()}, clusterCount);
+        return static_cast<int>(bestFit->lower);
+    }
+
+    // no extent is big enough -> the largest extents give the fewest fragments
+    std::stable_sort(extents.begin(), extents.end(), [&length](const Range& a, const Range& b) {
+        return length(a) > length(b);
+    });
+    uint needed = 0, taken = 0;
+    while (needed < clusterCount) needed += length(extents[taken++]);
+    extents.resize(taken);
+
+    // keep the fragments in disk order, so the file is read front to back
+    std::sort(extents.begin(), extents.end(), [](const Range& a, const Range& b) { return a.lower < b.lower; });
+    FAT::link_extents(extents, clusterCount);
+    return static_cast<int>(extents.front().lower);
+}
+
+int FAT::allocate_extent(uint clusterCount) {
+    if (clusterCount == 0 || clusterCount > mFreeCount) return FAT::FLAG_NO_FREE_SPACE;
+
+    auto bestFit = FAT::best_fit(FAT::free_extents(), clusterCount);
+    if (!bestFit) return FAT::FLAG_NO_FREE_SPACE;
+
+    FAT::link_extents({bestFit.value()}, clusterCount);
+    return static_cast<int>(bestFit->lower);
+}
+
+std::optional<Range> FAT::best_fit(const std::vector<Range>& extents, uint clusterCount) {
+    std::optional<Range> bestFit = std::nullopt;
+    for (const auto& extent : extents) {
+        uint length = extent.upper - extent.lower + 1;
+        if (length >= clusterCount && (!bestFit || length < bestFit->upper - bestFit->lower + 1))
+            bestFit = extent;
+    }
+    return bestFit;
+}
+
+void FAT::link_extents(const std::vector<Range>& extents, uint clusterCount) {
+    int previous = FAT::FLAG_UNUSED;
+    for (const auto& extent : extents) {
+        for (uint idx = extent.lower; idx <= extent.upper && clusterCount > 0; ++idx, --clusterCount) {
+            if (previous != FAT::FLAG_UNUSED) FAT::set_entry(previous, static_cast<int>(idx));
+            previous = static_cast<int>(idx);
+        }
     }
+    FAT::set_entry(previous, FAT::FLAG_FILE_END);
+}
+
+std::vector<Range> FAT::free_extents() const {
+    std::vector<Range> extents{};
+    const size_t wordCount = mFreeBitmap.size();
+
+    size_t idx = 0;
+    while (idx < table.size()) {
+        // find the next free cluster
+        size_t word = idx / 64;
+        uint64_t bits = mFreeBitmap[word] & (~uint64_t{0} << (idx % 64));
+        while (bits == 0 && ++word < wordCount) bits = mFreeBitmap[word];
+        if (bits == 0) break;
+        size_t lower = word * 64 + std::countr_zero(bits);
+
+        // find the next used cluster (bits past the end of table are never set)
+        bits = ~mFreeBitmap[word] & (~uint64_t{0} << (lower % 64));
+        while (bits == 0 && ++word < wordCount) bits = ~mFreeBitmap[word];
+        size_t upper = (bits == 0) ? table.size() : word * 64 + std::countr_zero(bits);
+
+        extents.push_back(Range{static_cast<uint>(lower), static_cast<uint>(upper - 1)});
+        idx = upper;
+    }
+    return extents;
 }
 // End : FAT
 
@@ -97,38 +335,23 @@ void DirEntry::init(const std::string& filename, bool isFile, uint size, uint st
     mStartCluster = startCLuster;
 }
 
-void DirEntry::mount(std::fstream &stream) {
-    mFilename = Utils::string_from_stream(stream, FILENAME_LEN);
-    mIsFile = Utils::read_from_stream<bool>(stream);
-    mSize = Utils::read_from_stream<uint>(stream);
-    mStartCluster = Utils::read_from_stream<uint>(stream);
+void DirEntry::mount(const char* data) {
+    Layout::decode(*this, data);
 }
 
-void DirEntry::write_to_disk(std::fstream &stream) {
-    Utils::string_to_stream(stream, mFilename);
-    Utils::write_to_stream(stream, mIsFile, mSize, mStartCluster);
+void DirEntry::write_to_buffer(char* data) const {
+    Layout::encode(*this, data);
 }
 
-void DirEntry::write_content_to_disk(std::fstream &stream, uint dataStartAddress, const std::vector<uint>& clusters, const std::string& content) const {
-    if (content.size() <= CLUSTER_SIZE) {
-        stream.seekp(dataStartAddress + this->mStartCluster * CLUSTER_SIZE);
-        Utils::string_to_stream(stream, content);
-    }
-    else {
-        // splitting file content into cluster sized bites
-        std::string part = content.substr(0, CLUSTER_SIZE);
-        std::string rest = content.substr(CLUSTER_SIZE);
-        for (auto cluster: clusters) {
-            stream.seekp(dataStartAddress + cluster * CLUSTER_SIZE);
-            Utils::string_to_stream(stream, part);
-
-            if (rest.size() > CLUSTER_SIZE) {
-                part = rest.substr(0, CLUSTER_SIZE);
-                rest = rest.substr(CLUSTER_SIZE);
-            } else {
-                part = rest;
-            }
-        }
+void DirEntry::write_content_to_disk(ClusterCache& cache, const std::vector<uint>& clusters, std::string_view content) const {
+    // adjacent clusters are merged into runs, each run is written straight from the source buffer at once
+    size_t offset = 0;
+    for (auto run : Utils::to_runs(clusters)) {
+        if (offset >= content.size()) break;
+
+        size_t sliceSize = std::min<size_t>(content.size() - offset, static_cast<size_t>(run.upper - run.lower + 1) * cache.cluster_size());
+        cache.write_run(run, content.data() + offset, sliceSize);
+        offset += sliceSize;
     }
 }
 
@@ -137,30 +360,204 @@ DirEntry::operator bool() const {
 }
 // End : DirEntry
 
-void Filesystem::wipe_all_clusters() {
-    mFileStream.seekp(mBS.mDataStartAddress);
-    auto clusterView = std::ranges::iota_view{0u, mBS.mClusterCount};
-    for ([[maybe_unused]] const auto& _ : clusterView) {
-        Utils::write_to_stream(mFileStream, mEmptyCluster);
+// Start : DirIndex
+void DirIndex::build(const char* data, uint count, uint slotOffset) {
+    size_t slotCount = 8;
+    while (slotCount < static_cast<size_t>(count) * 2) slotCount *= 2;
+    mSlots.assign(slotCount, Slot{false, 0, Dentry{}});
+    mCount = 0;
+
+    for (uint slot = 0; slot < count; ++slot) {
+        Dentry dentry{slot, DirEntry{}};
+        dentry.dirEntry.mount(data + slotOffset + slot * DirEntry::SIZE());
+        DirIndex::insert(dentry);
     }
 }
 
-void Filesystem::init(uint size) {
-    auto mode = std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc;
-    mFileStream.open(mDiskName, mode);
-    if (!mFileStream) {
-        std::cout << "Error opening disk" << std::endl;
-        exit(EXIT_FAILURE);
+size_t DirIndex::probe(std::string_view name, size_t hash) const {
+    size_t mask = mSlots.size() - 1;
+    size_t idx = hash & mask;
+    while (mSlots[idx].used) {
+        if (mSlots[idx].hash == hash && mSlots[idx].dentry.dirEntry.name() == name) break;
+        idx = (idx + 1) & mask;
+    }
+    return idx;
+}
+
+void DirIndex::rehash(size_t slotCount) {
+    std::vector<Slot> oldSlots(slotCount, Slot{false, 0, Dentry{}});
+    std::swap(mSlots, oldSlots);
+    for (auto& slot : oldSlots) {
+        if (!slot.used) continue;
+        mSlots[DirIndex::probe(slot.dentry.dirEntry.name(), slot.hash)] = std::move(slot);
+    }
+}
+
+const Dentry* DirIndex::find(std::string_view name) const {
+    const auto& slot = mSlots[DirIndex::probe(name, std::hash<std::string_view>{}(name))];
+    return slot.used ? &slot.dentry : nullptr;
+}
+
+void DirIndex::insert(const Dentry& dentry) {
+    // keep load factor at most 1/2
+    if ((mCount + 1) * 2 > mSlots.size()) DirIndex::rehash(mSlots.size() * 2);
+
+    // names of a bucket share their low Utils::hash_name() bits, so another hash is used
+    size_t hash = std::hash<std::string_view>{}(dentry.dirEntry.name());
+    auto& slot = mSlots[DirIndex::probe(dentry.dirEntry.name(), hash)];
+    if (!slot.used) mCount++;
+    slot = Slot{true, hash, dentry};
+}
+
+void DirIndex::erase(std::string_view name) {
+    size_t mask = mSlots.size() - 1;
+    size_t hole = DirIndex::probe(name, std::hash<std::string_view>{}(name));
+    if (!mSlots[hole].used) return;
+    mSlots[hole].used = false;
+    mCount--;
+
+    // shift back the following slots of the cluster, if the hole lies on their probe path
+    for (size_t idx = (hole + 1) & mask; mSlots[idx].used; idx = (idx + 1) & mask) {
+        size_t home = mSlots[idx].hash & mask;
+        bool reachable = (hole <= idx) ? (hole < home && home <= idx) : (hole < home || home <= idx);
+        if (reachable) continue;
+
+        mSlots[hole] = std::move(mSlots[idx]);
+        mSlots[idx].used = false;
+        hole = idx;
+    }
+}
+// End : DirIndex
+
+// Start : DentryCache
+void DentryCache::evict(size_t incoming) {
+    while (!mLru.empty() && mEntries + incoming > mCapacity) {
+        mEntries -= mLru.back().dirIndex.size();
+        mIndex.erase(mLru.back().cluster);
+        mLru.pop_back();
+    }
+}
+
+const DirIndex* DentryCache::get(uint cluster) {
+    auto it = mIndex.find(cluster);
+    if (it == mIndex.end()) return nullptr;
+    mLru.splice(mLru.begin(), mLru, it->second);
+    return &mLru.front().dirIndex;
+}
+
+const DirIndex& DentryCache::put(uint cluster, const char* data, uint count, uint slotOffset) {
+    DentryCache::drop(cluster);
+    DentryCache::evict(count);
+
+    mLru.push_front(Entry{cluster, DirIndex{}});
+    mLru.front().dirIndex.build(data, count, slotOffset);
+    mIndex[cluster] = mLru.begin();
+    mEntries += mLru.front().dirIndex.size();
+    return mLru.front().dirIndex;
+}
+
+void DentryCache::insert(uint cluster, const Dentry& dentry) {
+    auto it = mIndex.find(cluster);
+    if (it == mIndex.end()) return;
+
+    DirIndex& dirIndex = it->second->dirIndex;
+    mEntries -= dirIndex.size();
+    dirIndex.insert(dentry);
+    mEntries += dirIndex.size();
+}
+
+void DentryCache::erase(uint cluster, std::string_view name) {
+    auto it = mIndex.find(cluster);
+    if (it == mIndex.end()) return;
+
+    DirIndex& dirIndex = it->second->dirIndex;
+    mEntries -= dirIndex.size();
+    dirIndex.erase(name);
+    mEntries += dirIndex.size();
+}
+
+void DentryCache::drop(uint cluster) {
+    auto it = mIndex.find(cluster);
+    if (it == mIndex.end()) return;
+    mEntries -= it->second->dirIndex.size();
+    mLru.erase(it->second);
+    mIndex.erase(it);
+}
+
+void DentryCache::clear() {
+    mLru.clear();
+    mIndex.clear();
+    mEntries = 0;
+}
+// End : DentryCache
+
+// Start : BucketCache
+std::vector<uint>* BucketCache::get(uint cluster) {
+    auto it = mIndex.find(cluster);
+    if (it == mIndex.end()) return nullptr;
+    mLru.splice(mLru.begin(), mLru, it->second);
+    return &mLru.front().buckets;
+}
+
+std::vector<uint>& BucketCache::put(uint cluster, std::vector<uint> buckets) {
+    BucketCache::drop(cluster);
+    if (mLru.size() >= mCapacity) {
+        mIndex.erase(mLru.back().cluster);
+        mLru.pop_back();
     }
 
+    mLru.push_front(Entry{cluster, std::move(buckets)});
+    mIndex[cluster] = mLru.begin();
+    return mLru.front().buckets;
+}
+
+void BucketCache::drop(uint cluster) {
+    auto it = mIndex.find(cluster);
+    if (it == mIndex.end()) return;
+    mLru.erase(it->second);
+    mIndex.erase(it);
+}
+
+void BucketCache::clear() {
+    mLru.clear();
+    mIndex.clear();
+}
+// End : BucketCache
+
+void Filesystem::wipe_all_clusters() {
+    std::vector<char> zeros(static_cast<size_t>(mChunkClusters) * mBS.mClusterSize, '\0');
+    mJournal.seek(mBS.mDataStartAddress);
+    for (uint cluster = 0; cluster < mBS.mClusterCount; cluster += mChunkClusters) {
+        uint count = std::min(mChunkClusters, mBS.mClusterCount - cluster);
+        mJournal.write(zeros.data(), static_cast<size_t>(count) * mBS.mClusterSize);
+    }
+}
+
+Filesystem::~Filesystem() {
+    // the journal outlives the FAT and the cluster cache, its last commit has to release freed clusters now
+    if (mDisk == nullptr) return;
+    mJournal.commit();
+    mJournal.on_commit(nullptr);
+}
+
+void Filesystem::init(uint size, uint clusterSize, bool fatMirror) {
     // construct disk sections
     mBS = BootSector();
     mFAT = FAT();
     mRootDir = DirEntry();
 
     // init disk sections
-    mBS.init(size);
-    mFAT.init(mBS.mClusterCount);
+    mBS.init(size, clusterSize, fatMirror);
+    mChunkClusters = std::max(1u, IO_CHUNK_SIZE / mBS.mClusterSize);
+
+    // image size is known only after the BootSector is initialized
+    mDisk = Disk::make(mBackend);
+    if (!mDisk->create(mDiskName, mBS.mDataStartAddress + static_cast<size_t>(mBS.mClusterCount) * mBS.mClusterSize)) {
+        std::cout << "Error opening disk" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    mFAT.init(mBS.mClusterCount, mBS.mClusterSize);
     mFAT.write_FAT(0, 0);
     mRootDir.init("/", false, 0, 0);
     DirEntry dot, dotdot;
@@ -168,23 +565,37 @@ void Filesystem::init(uint size) {
     dotdot.init("..", false, 0, 0);     // '..' in root points to itself
 
     // saving info to disk
-    mBS.write_to_disk(mFileStream);
-    mFileStream.seekp(mBS.mFatStartAddress);
-    mFAT.write_to_disk(mFileStream);
+    mWriteBack.attach(*mDisk, mBS.mDataStartAddress, mBS.mClusterSize);
+    mJournal.attach(mWriteBack, mBS.journal_start_address(), mBS.journal_size());
+    mJournal.format();
+    mJournal.on_commit([this] { Filesystem::journal_committed(); });
+    mBS.write_to_disk(mJournal);
+    mJournal.seek(mBS.mFatStartAddress);
+    mFAT.write_to_disk(mJournal);
+    if (fatMirror) {
+        mJournal.seek(mBS.fat2_start_address());
+        mFAT.write_to_disk(mJournal);
+    }
     Filesystem::wipe_all_clusters();
+    mCache.init(mJournal, mBS.mDataStartAddress, mBS.mClusterSize);
+    mBucketCache.clear();
+    mDentryCache.clear();
+    mOpenFiles.clear();
 
-    // save rootDir info to disk
-    mFileStream.seekp(mBS.mDataStartAddress);
-    Utils::write_to_stream(mFileStream, mTwoDirEntries);
-    dot.write_to_disk(mFileStream);
-    dotdot.write_to_disk(mFileStream);
+    // save rootDir info to disk, FAT2 gets written by its own handle of the disk from now on
+    Filesystem::write_dir_cluster(0, dot, dotdot);
+    mJournal.flush();
+    Filesystem::start_fat_mirror();
 
 //    Filesystem::init_default_files();
 }
 
 void Filesystem::mount() {
-    auto mode = std::ios::in | std::ios::out | std::ios::binary | std::ios::ate;
-    mFileStream.open(mDiskName, mode);
+    mDisk = Disk::make(mBackend);
+    if (!mDisk->open(mDiskName)) {
+        std::cout << "Error opening disk" << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
     // construct disk sections
     mBS = BootSector();
@@ -192,131 +603,534 @@ void Filesystem::mount() {
     mRootDir = DirEntry();
 
     // read info from disk and init
-    mFileStream.seekg(0);
-    mBS.mount(mFileStream);
-    mFAT.init(mBS.mClusterCount);
-    mFileStream.seekg(mBS.mFatStartAddress);
-    mFAT.mount(mFileStream);
+    mDisk->seek(0);
+    mBS.mount(*mDisk);
+    if (!Utils::is_valid_cluster_size(mBS.mClusterSize)) {
+        std::cout << "Invalid cluster size: " << mBS.mClusterSize << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    mChunkClusters = std::max(1u, IO_CHUNK_SIZE / mBS.mClusterSize);
+
+    // a group committed before a crash is finished first
+    mWriteBack.attach(*mDisk, mBS.mDataStartAddress, mBS.mClusterSize);
+    mJournal.attach(mWriteBack, mBS.journal_start_address(), mBS.journal_size());
+    if (mJournal.replay()) std::cout << "Journal replayed" << std::endl;
+    mJournal.on_commit([this] { Filesystem::journal_committed(); });
+
+    mFAT.init(mBS.mClusterCount, mBS.mClusterSize);
+    mJournal.seek(mBS.mFatStartAddress);
+    mFAT.mount(mJournal);
+    Filesystem::start_fat_mirror();
+    Filesystem::verify_fat_mirror();
+    mCache.init(mJournal, mBS.mDataStartAddress, mBS.mClusterSize);
+    mBucketCache.clear();
+    mDentryCache.clear();
+    mOpenFiles.clear();
+
+    // references of shared clusters are not stored, they are counted from the directory tree
+    std::vector<bool> seen(mBS.mClusterCount, false);
+    Filesystem::count_references(0, seen);
+}
+
+void Filesystem::count_references(uint dirCluster, std::vector<bool>& seen) {
+    for (const auto& dirEntry : Filesystem::read_dir_entry_as_dir(Filesystem::get_dir_entry(dirCluster, false, false))) {
+        if (dirEntry.name() == "." || dirEntry.name() == "..") continue;
+        if (!dirEntry.mIsFile) {
+            Filesystem::count_references(dirEntry.mStartCluster, seen);
+            continue;
+        }
+
+        for (int cluster = static_cast<int>(dirEntry.mStartCluster); cluster != FAT::FLAG_FILE_END; cluster = mFAT.table[cluster]) {
+            if (seen[cluster]) mFAT.add_reference(cluster);
+            else seen[cluster] = true;
+        }
+    }
+}
+
+void Filesystem::flush_fat() {
+    {
+        auto metadata = mJournal.metadata();
+        if (!mMirror.running()) mFAT.flush(mJournal, mBS.mFatStartAddress);
+        else mFAT.flush(mJournal, mBS.mFatStartAddress, [this](uint firstEntry, std::span<const int> entries) {
+            mMirror.stage(firstEntry, entries);
+        });
+    }
+
+    // without a journal the flushed pages are already in place
+    if (!mJournal.enabled()) Filesystem::journal_committed();
+}
+
+void Filesystem::journal_committed() {
+    mMirror.publish();
+    Filesystem::release_freed_clusters();
+}
+
+void Filesystem::release_freed_clusters() {
+    auto clusters = mFAT.take_releasable();
+    if (clusters.empty()) return;
+
+    // free clusters are kept wiped
+    Filesystem::wipe_clusters(clusters);
+    mFAT.release(clusters);
+}
+
+bool Filesystem::reserve_free(size_t clusters) {
+    // clusters freed by the pending group become free only once it is committed
+    if (mFAT.free_count() < clusters && mFAT.unreleased_count() > 0) mJournal.commit();
+    return mFAT.free_count() >= clusters;
+}
+
+void Filesystem::start_fat_mirror() {
+    mMirror.stop();
+    if (mBS.fat2_start_address() == 0) return;
+    if (!mMirror.start(Disk::make(mBackend), mDiskName, mBS.fat2_start_address(), FAT::PAGE_ENTRIES))
+        std::cout << "Cannot open disk for FAT2, it will not be updated" << std::endl;
+}
+
+void Filesystem::verify_fat_mirror() {
+    if (mBS.fat2_start_address() == 0) return;
+
+    std::vector<int> mirror(mBS.mClusterCount);
+    mJournal.read_at(mBS.fat2_start_address(), reinterpret_cast<char *>(mirror.data()), mirror.size() * sizeof(int));
+    if (mirror == mFAT.table) return;
+
+    // FAT is the one to be trusted while it is valid, FAT2 may lag behind it
+    if (!FAT::is_valid(mFAT.table) && FAT::is_valid(mirror)) {
+        std::cout << "FAT is damaged, restoring it from FAT2" << std::endl;
+        mFAT.restore(mirror);
+        Filesystem::flush_fat();
+        mJournal.commit();
+        return;
+    }
+    std::cout << "FAT2 is out of date, rewriting it" << std::endl;
+    if (mMirror.running()) mMirror.enqueue(0, mFAT.table);
+}
+
+void Filesystem::write_dir_cluster(uint cluster, const DirEntry& dot, const DirEntry& dotdot) {
+    auto metadata = mJournal.metadata();
+    std::vector<char> data(Filesystem::slot_offset(2));     // free clusters are kept wiped, the rest stays zero
+    std::memcpy(data.data(), &mTwoDirEntries, sizeof(mTwoDirEntries));
+    std::array<DirEntry, 2> dots{dot, dotdot};
+    DirEntry::Layout::encode_all(std::span<const DirEntry>{dots}, data.data() + Filesystem::slot_offset(0));
+    mCache.write(cluster, 0, data.data(), data.size());
+    mDentryCache.drop(cluster);
+}
+
+void Filesystem::write_dir_entry(uint cluster, uint position, const DirEntry& dirEntry) {
+    auto metadata = mJournal.metadata();
+    std::array<char, DirEntry::SIZE()> data{};
+    dirEntry.write_to_buffer(data.data());
+
+    uint bucketCluster = Filesystem::get_dir_buckets(cluster)[position / mBS.mMaxDirEntries];
+    uint offset = Filesystem::slot_offset(position % mBS.mMaxDirEntries);
+    mCache.write(bucketCluster, offset, data.data(), DirEntry::SIZE());
+
+    // the DirEntry keeps its name, only its index entry is updated
+    mDentryCache.insert(bucketCluster, Dentry{position % mBS.mMaxDirEntries, dirEntry});
+}
+
+void Filesystem::write_bucket_entry_count(uint cluster, uint count) {
+    auto metadata = mJournal.metadata();
+    mCache.write(cluster, 0, reinterpret_cast<const char *>(&count), sizeof(count));
+}
+
+void Filesystem::write_bucket(uint cluster, uint count, uint slot, const DirEntry& dirEntry) {
+    std::array<char, DirEntry::SIZE()> data{};
+    dirEntry.write_to_buffer(data.data());
+
+    // the journal commits both writes together; without it, the DirEntry goes first,
+    // so a crash in between leaves it unreferenced or duplicated rather than lost
+    auto metadata = mJournal.metadata();
+    mCache.write(cluster, Filesystem::slot_offset(slot), data.data(), data.size());
+    Filesystem::write_bucket_entry_count(cluster, count);
+}
+
+void Filesystem::read_buckets(uint dirCluster, const BucketConsumer& consumer) {
+    auto buckets = Filesystem::get_dir_buckets(dirCluster);
+    if (buckets.size() == 1) {  // the usual small directory, most likely cached
+        consumer(0, mCache.read(buckets.front()).data());
+        return;
+    }
+
+    std::vector<char> chunk(std::min<size_t>(buckets.size(), mChunkClusters) * mBS.mClusterSize);
+    uint bucket = 0;
+    Utils::with_cluster_size(mBS.mClusterSize, [&](auto clusterSize) {
+        for (auto run : Utils::to_runs(buckets)) {
+            for (uint lower = run.lower; lower <= run.upper; lower += mChunkClusters) {
+                uint upper = std::min(run.upper, lower + mChunkClusters - 1);
+                mCache.read_run(Range{lower, upper}, chunk.data());
+
+                for (uint i = 0; i <= upper - lower; ++i) {
+                    consumer(bucket++, chunk.data() + static_cast<size_t>(i) * clusterSize);
+                }
+            }
+        }
+    });
+}
+
+uint Filesystem::get_bucket_entry_count(uint cluster) {
+    uint count;
+    std::memcpy(&count, mCache.read(cluster).data(), sizeof(count));
+    return count;
 }
 
 DirEntry Filesystem::get_dir_entry(uint cluster, bool isFile, bool last) {
     DirEntry dirEntry;
-    mFileStream.seekp(mBS.mDataStartAddress + (cluster * CLUSTER_SIZE));
+    auto data = mCache.read(cluster);
 
     if (last) {     // this option is used if we want last dirEntry of directory
-        auto dirEntryCount = Utils::read_from_stream<uint>(mFileStream);
-        mFileStream.seekg((dirEntryCount - 1) * dirEntry.SIZE(), std::ios::cur);
-        dirEntry.mount(mFileStream);
+        uint dirEntryCount;
+        std::memcpy(&dirEntryCount, data.data(), sizeof(dirEntryCount));
+        dirEntry.mount(data.data() + Filesystem::slot_offset(dirEntryCount - 1));
         return dirEntry;
     }
-    if (!isFile) Utils::read_from_stream<uint>(mFileStream);    // if dir, skip offset
-    dirEntry.mount(mFileStream);
+    dirEntry.mount(data.data() + (isFile ? 0 : Filesystem::slot_offset(0)));     // if dir, skip offset
     return dirEntry;
 }
 
-int Filesystem::get_position(const std::string& searched, const DirEntry& parent) {
-    auto dirEntries = Filesystem::read_dir_entry_as_dir(parent);
+std::vector<uint>& Filesystem::get_dir_buckets(uint dirCluster) {
+    std::vector<uint>* buckets = mBucketCache.get(dirCluster);
+    if (buckets != nullptr) return *buckets;
 
-    int i = 0;
-    for (const auto& dirEntry : dirEntries) {
-        if (Utils::remove_padding(dirEntry.mFilename) == searched) return i;
-        else i++;
-    }
-    return -1;
+    DirEntry dir;
+    dir.mStartCluster = dirCluster;
+    return mBucketCache.put(dirCluster, Filesystem::get_cluster_locations(dir));
+}
+
+const DirIndex& Filesystem::get_bucket_index(uint bucketCluster) {
+    const DirIndex* dirIndex = mDentryCache.get(bucketCluster);
+    if (dirIndex != nullptr) return *dirIndex;
+
+    auto data = mCache.read(bucketCluster);
+    uint count;
+    std::memcpy(&count, data.data(), sizeof(count));
+    return mDentryCache.put(bucketCluster, data.data(), count, Filesystem::slot_offset(0));
+}
+
+uint Filesystem::bucket_of(std::string_view name, uint bucketCount) {
+    if (name == "." || name == "..") return 0;
+
+    // linear hashing - buckets before the split pointer are already split in this round
+    uint hash = Utils::hash_name(name);
+    uint level = std::bit_floor(bucketCount);
+    uint bucket = hash & (level - 1);
+    if (bucket < bucketCount - level) bucket = hash & (2 * level - 1);
+    return bucket;
+}
+
+std::optional<Dentry> Filesystem::find_dir_entry(std::string_view name, const DirEntry& parent) {
+    if (parent.mIsFile) throw std::runtime_error("Cannot get child dirEntries of a file");
+    name = name.substr(0, FILENAME_LEN);
+
+    const auto& buckets = Filesystem::get_dir_buckets(parent.mStartCluster);
+    uint bucket = Filesystem::bucket_of(name, buckets.size());
+    const Dentry* dentry = Filesystem::get_bucket_index(buckets[bucket]).find(name);
+    if (dentry == nullptr) return std::nullopt;
+    return Dentry{bucket * mBS.mMaxDirEntries + dentry->position, dentry->dirEntry};
+}
+
+int Filesystem::get_position(const std::string& searched, const DirEntry& parent) {
+    auto dentry = Filesystem::find_dir_entry(searched, parent);
+    return dentry ? static_cast<int>(dentry->position) : -1;
 }
 
 uint Filesystem::get_child_dir_entry_count(const DirEntry &dirEntry) {
     if (dirEntry.mIsFile) throw std::runtime_error("Cannot get child dirEntries of a file");
 
-    mFileStream.seekg(mBS.mDataStartAddress + dirEntry.mStartCluster * CLUSTER_SIZE);
-    return Utils::read_from_stream<uint>(mFileStream);
+    uint dirEntryCount = 0;
+    Filesystem::read_buckets(dirEntry.mStartCluster, [&dirEntryCount](uint, const char* data) {
+        uint count;
+        std::memcpy(&count, data, sizeof(count));
+        dirEntryCount += count;
+    });
+    return dirEntryCount;
 }
 
-std::optional<DirEntry> Filesystem::create_dir_entry(uint parentCluster, const std::string& name, bool isFile, const std::string& content) {
-    // create new file
-    DirEntry newDirEntry, dot, dotdot;
-    long int startCluster = mFAT.find_free_index(-1);
+std::optional<uint> Filesystem::reserve_dir_slot(uint dirCluster, std::string_view name) {
+    name = name.substr(0, FILENAME_LEN);
 
-    // check for free space
-    if (startCluster == FAT::FLAG_NO_FREE_SPACE) {
-        std::cout << "FAT table is full. Delete some files before creating new ones" << std::endl;
-        return std::nullopt;
+    // every split goes to the next bucket in turn, so one doubling of the directory splits any full bucket
+    uint maxSplits = Filesystem::get_dir_buckets(dirCluster).size();
+    for (uint splits = 0; splits <= maxSplits; ++splits) {
+        const auto& buckets = Filesystem::get_dir_buckets(dirCluster);
+        uint bucket = Filesystem::bucket_of(name, buckets.size());
+        uint count = Filesystem::get_bucket_entry_count(buckets[bucket]);
+        if (count < mBS.mMaxDirEntries) return bucket * mBS.mMaxDirEntries + count;
+
+        if (!Filesystem::split_dir_bucket(dirCluster)) break;
     }
+    return std::nullopt;
+}
 
-    newDirEntry.init(name, isFile, content.size(), startCluster);
-    dotdot = Filesystem::get_dir_entry(parentCluster, false, false);
+bool Filesystem::split_dir_bucket(uint dirCluster) {
+    auto& buckets = Filesystem::get_dir_buckets(dirCluster);
+    uint bucketCount = buckets.size();
 
-    // check for existing filename in parent dir
-    auto dirEntries = Filesystem::read_dir_entry_as_dir(dotdot);
-    bool isDuplicate = std::any_of(dirEntries.begin(), dirEntries.end(), [&name](const DirEntry& dirEntry) {
-        return Utils::remove_padding(dirEntry.mFilename) == name;
+    // link the new bucket first, it is already wiped
+    if (!Filesystem::reserve_free(1)) return false;
+    int newCluster = mFAT.append(buckets.back());
+    if (newCluster == FAT::FLAG_NO_FREE_SPACE) return false;
+    Filesystem::flush_fat();
+    buckets.push_back(newCluster);
+
+    // DirEntries of the split bucket either stay or move to the new bucket
+    uint split = bucketCount - std::bit_floor(bucketCount);
+    std::vector<char> stayData(mBS.mClusterSize), moveData(mBS.mClusterSize);     // only used slots get written
+    auto data = mCache.read(buckets[split]);
+    uint count, stayCount = 0, moveCount = 0;
+    std::memcpy(&count, data.data(), sizeof(count));
+    for (uint i = 0; i < count; ++i) {
+        const char* raw = data.data() + Filesystem::slot_offset(i);
+        uint bucket = Filesystem::bucket_of(DirEntry::raw_name(raw), bucketCount + 1);
+
+        char* target = (bucket == split) ? stayData.data() + Filesystem::slot_offset(stayCount++)
+                                         : moveData.data() + Filesystem::slot_offset(moveCount++);
+        std::memcpy(target, raw, DirEntry::SIZE());
+    }
+    std::memcpy(stayData.data(), &stayCount, sizeof(stayCount));
+    std::memcpy(moveData.data(), &moveCount, sizeof(moveCount));
+
+    // a moved DirEntry is reachable from the new bucket before it disappears from the old one
+    auto metadata = mJournal.metadata();
+    mCache.write(newCluster, 0, moveData.data(), Filesystem::slot_offset(moveCount));
+    mCache.write(buckets[split], 0, stayData.data(), Filesystem::slot_offset(stayCount));
+    mDentryCache.drop(newCluster);
+    mDentryCache.drop(buckets[split]);
+    return true;
+}
+
+void Filesystem::merge_dir_buckets(uint dirCluster) {
+    auto metadata = mJournal.metadata();
+    auto& buckets = Filesystem::get_dir_buckets(dirCluster);
+    while (buckets.size() > 1) {
+        uint last = buckets.size() - 1;
+        uint split = last - std::bit_floor(last);   // bucket the last one was split from
+        uint lastCount = Filesystem::get_bucket_entry_count(buckets[last]);
+        uint splitCount = Filesystem::get_bucket_entry_count(buckets[split]);
+        if (lastCount + splitCount > mBS.mMaxDirEntries / 2) return;
+
+        // move DirEntries back to the split bucket
+        if (lastCount > 0) {
+            auto lastData = mCache.read(buckets[last]);
+            std::vector<char> data(lastData.begin() + Filesystem::slot_offset(0), lastData.begin() + Filesystem::slot_offset(lastCount));
+            mCache.write(buckets[split], Filesystem::slot_offset(splitCount), data.data(), data.size());
+            Filesystem::write_bucket_entry_count(buckets[split], splitCount + lastCount);
+            mDentryCache.drop(buckets[split]);
+        }
+
+        // free the last bucket, it is wiped once the group freeing it is committed
+        mDentryCache.drop(buckets[last]);
+        mFAT.truncate(buckets[last - 1]);
+        Filesystem::flush_fat();
+        buckets.pop_back();
+    }
+}
+
+std::optional<DirEntry> Filesystem::create_dir_entry(uint parentCluster, const std::string& name, bool isFile, const std::string& content) {
+    auto operation = mJournal.operation();
+    auto newDirEntry = Filesystem::allocate_dir_entry(parentCluster, name, isFile, content.size());
+    if (!newDirEntry) return std::nullopt;
+
+    // save new file content into disk
+    auto clusters = Filesystem::get_cluster_locations(newDirEntry.value());
+    newDirEntry->write_content_to_disk(mCache, clusters, content);
+
+    return newDirEntry;
+}
+
+std::optional<DirEntry> Filesystem::create_dir_entry(uint parentCluster, const std::string& name, std::istream& source, size_t size) {
+    auto operation = mJournal.operation();
+    auto newDirEntry = Filesystem::allocate_dir_entry(parentCluster, name, true, size);
+    if (!newDirEntry) return std::nullopt;
+
+    // read source chunk by chunk and write each chunk straight into the allocated clusters
+    std::vector<char> chunk(static_cast<size_t>(mChunkClusters) * mBS.mClusterSize);
+    std::vector<uint> chunkClusters{};
+    int cluster = static_cast<int>(newDirEntry->mStartCluster);
+    size_t remaining = size;
+    Utils::with_cluster_size(mBS.mClusterSize, [&](auto clusterSize) {
+        while (remaining > 0) {
+            size_t chunkSize = std::min(remaining, chunk.size());
+            source.read(chunk.data(), static_cast<std::streamsize>(chunkSize));
+
+            // zero the slack of the last cluster (and whatever the source failed to deliver)
+            size_t paddedSize = (chunkSize + clusterSize - 1) / clusterSize * clusterSize;
+            std::fill(chunk.begin() + source.gcount(), chunk.begin() + static_cast<long>(paddedSize), '\0');
+
+            chunkClusters.clear();
+            for (size_t offset = 0; offset < paddedSize; offset += clusterSize) {
+                chunkClusters.push_back(cluster);
+                cluster = mFAT.table[cluster];
+            }
+            newDirEntry->write_content_to_disk(mCache, chunkClusters, std::string_view{chunk.data(), paddedSize});
+            remaining -= chunkSize;
+        }
     });
-    if (isDuplicate) {
+
+    return newDirEntry;
+}
+
+std::optional<uint> Filesystem::find_room(uint parentCluster, const std::string& name) {
+    // check for existing filename in parent dir
+    if (Filesystem::find_dir_entry(name, Filesystem::get_dir_entry(parentCluster, false, false))) {
         std::cout << name << " already exists" << std::endl;
         return std::nullopt;
     }
 
-    // new dirEntry is a dir
-    if (!isFile) {
-        dot.init(".", isFile, 0, startCluster);
-        dotdot.mFilename = Utils::zero_padded_string("..", FILENAME_LEN);
+    // find free room in parent dir - the dir grows by a bucket if needed
+    auto position = Filesystem::reserve_dir_slot(parentCluster, name);
+    if (!position) std::cout << "Directory is full. Cannot create " << name << std::endl;
+    return position;
+}
 
-        mFileStream.seekp(mBS.mDataStartAddress + dot.mStartCluster * CLUSTER_SIZE);
-        Utils::write_to_stream(mFileStream, mTwoDirEntries);
-        dot.write_to_disk(mFileStream);
-        dotdot.write_to_disk(mFileStream);
+void Filesystem::insert_dir_entry(uint parentCluster, uint position, const DirEntry& dirEntry) {
+    uint bucketCluster = Filesystem::get_dir_buckets(parentCluster)[position / mBS.mMaxDirEntries];
+    uint slot = position % mBS.mMaxDirEntries;
+    Filesystem::write_bucket(bucketCluster, slot + 1, slot, dirEntry);
+
+    mDentryCache.insert(bucketCluster, Dentry{slot, dirEntry});
+}
+
+std::optional<DirEntry> Filesystem::allocate_dir_entry(uint parentCluster, const std::string& name, bool isFile, size_t size) {
+    // size of a DirEntry is stored in 32 bits
+    if (size > UINT_MAX) {
+        std::cout << name << " is too large" << std::endl;
+        return std::nullopt;
     }
-    // set content of new file into FAT table
-    bool ok = mFAT.write_FAT(startCluster, content.size());
 
-    // if not enough space to create file -> revert back FAT table by mounting it again from disk
-    if (not ok) {
-        mFAT.init(mBS.mClusterCount);
-        mFileStream.seekg(mBS.mFatStartAddress);
-        mFAT.mount(mFileStream);
+    auto position = Filesystem::find_room(parentCluster, name);
+    if (!position) return std::nullopt;
+
+    // set content of new file into FAT table - nothing changes if there is not enough space
+    Filesystem::reserve_free(mFAT.cluster_count(size));
+    int startCluster = mFAT.allocate(size);
+    if (startCluster == FAT::FLAG_NO_FREE_SPACE) {
         std::cout << "FAT table is full. Delete some files before creating new ones" << std::endl;
         return std::nullopt;
     }
+    // create new file
+    DirEntry newDirEntry, dot, dotdot;
+    newDirEntry.init(name, isFile, size, startCluster);
 
-    // no problem - save changed FAT into disk
-    mFileStream.seekp(mBS.mFatStartAddress);
-    mFAT.write_to_disk(mFileStream);
+    // new dirEntry is a dir
+    if (!isFile) {
+        dot.init(".", isFile, 0, startCluster);
+        dotdot = Filesystem::get_dir_entry(parentCluster, false, false);
+        dotdot.mFilename = Utils::zero_padded_string("..", FILENAME_LEN);
 
-    // save new info of parent dir to disk
-    uint dirEntryCount = Filesystem::get_child_dir_entry_count(dotdot) + 1;
-    mFileStream.seekp(mBS.mDataStartAddress + dotdot.mStartCluster * CLUSTER_SIZE);
-    Utils::write_to_stream(mFileStream, dirEntryCount);
+        Filesystem::write_dir_cluster(dot.mStartCluster, dot, dotdot);
+    }
 
-    // write new file meta-info as content of parent dir
-    mFileStream.seekp((dirEntryCount - 1) * dotdot.SIZE(), std::ios::cur);
-    newDirEntry.write_to_disk(mFileStream);
+    // no problem - save changed FAT pages into disk
+    Filesystem::flush_fat();
 
-    // save new file content into disk
-    auto clusters = Filesystem::get_cluster_locations(newDirEntry);
-    newDirEntry.write_content_to_disk(mFileStream, mBS.mDataStartAddress, clusters, content);
+    // write new file meta-info into its bucket of parent dir
+    Filesystem::insert_dir_entry(parentCluster, position.value(), newDirEntry);
 
     return newDirEntry;
 }
 
 std::optional<DirEntry> Filesystem::copy_dir_entry(uint parentCluster, const DirEntry& toCopy, const std::string& nameOfCopy) {
-    std::string fileContent = Filesystem::read_dir_entry_as_file(toCopy);
+    auto operation = mJournal.operation();
     // copied file cannot be a directory and might already exist
-    auto copiedDirEntry = Filesystem::create_dir_entry(parentCluster, nameOfCopy, toCopy.mIsFile, fileContent);
+    if (!toCopy.mIsFile) {
+        std::cout << Utils::remove_padding(toCopy.mFilename) << " is a directory" << std::endl;
+        return std::nullopt;
+    }
+    auto position = Filesystem::find_room(parentCluster, nameOfCopy);
+    if (!position) return std::nullopt;
 
-    if (!copiedDirEntry) return std::nullopt;
-    else return copiedDirEntry;
+    // the copy shares the cluster chain, clusters get copied once either file is modified
+    DirEntry copiedDirEntry;
+    copiedDirEntry.init(nameOfCopy, true, toCopy.mSize, toCopy.mStartCluster);
+    mFAT.share(toCopy.mStartCluster);
+    Filesystem::insert_dir_entry(parentCluster, position.value(), copiedDirEntry);
+
+    return copiedDirEntry;
+}
+
+std::optional<DirEntry> Filesystem::concat_dir_entries(uint parentCluster, const DirEntry& first, const DirEntry& second, const std::string& name) {
+    auto operation = mJournal.operation();
+    if (!first.mIsFile || !second.mIsFile) {
+        std::cout << "Cannot concatenate a directory" << std::endl;
+        return std::nullopt;
+    }
+    size_t size = static_cast<size_t>(first.mSize) + second.mSize;
+    if (size > UINT_MAX) {
+        std::cout << name << " would be too large" << std::endl;
+        return std::nullopt;
+    }
+
+    // an empty file adds nothing - the other one is copied
+    if (second.mSize == 0) return Filesystem::copy_dir_entry(parentCluster, first, name);
+    if (first.mSize == 0) return Filesystem::copy_dir_entry(parentCluster, second, name);
+
+    const uint clusterSize = mBS.mClusterSize;
+    if (first.mSize % clusterSize == 0) {
+        // the last cluster of the first file is full, so the chain of the second one can follow it
+        auto position = Filesystem::find_room(parentCluster, name);
+        if (!position) return std::nullopt;
+
+        Filesystem::reserve_free(mFAT.cluster_count(first.mSize));
+        int startCluster = mFAT.allocate(first.mSize);
+        if (startCluster == FAT::FLAG_NO_FREE_SPACE) {
+            std::cout << "FAT table is full. Delete some files before creating new ones" << std::endl;
+            return std::nullopt;
+        }
+        DirEntry newDirEntry;
+        newDirEntry.init(name, true, size, startCluster);
+        auto clusters = Filesystem::get_cluster_locations(newDirEntry);
+        Filesystem::copy_clusters(Filesystem::get_cluster_locations(first), clusters);
+
+        mFAT.link(clusters.back(), static_cast<int>(second.mStartCluster));
+        mFAT.share(second.mStartCluster);
+        Filesystem::flush_fat();
+        Filesystem::insert_dir_entry(parentCluster, position.value(), newDirEntry);
+        return newDirEntry;
+    }
+
+    // content of the second file is shifted, it is gathered into whole chunks of the new file
+    auto newDirEntry = Filesystem::allocate_dir_entry(parentCluster, name, true, size);
+    if (!newDirEntry) return std::nullopt;
+
+    auto clusters = Filesystem::get_cluster_locations(newDirEntry.value());
+    std::vector<char> chunk(std::min<size_t>(clusters.size(), mChunkClusters) * clusterSize);
+    size_t filled = 0, written = 0;    // written in clusters
+    auto flush_chunk = [&]() {
+        size_t count = (filled + clusterSize - 1) / clusterSize;
+        std::vector<uint> chunkClusters(clusters.begin() + written, clusters.begin() + written + count);
+        newDirEntry->write_content_to_disk(mCache, chunkClusters, std::string_view{chunk.data(), filled});
+        written += count;
+        filled = 0;
+    };
+    auto gather = [&](std::span<const char> data) {
+        while (!data.empty()) {
+            size_t count = std::min(data.size(), chunk.size() - filled);
+            std::memcpy(chunk.data() + filled, data.data(), count);
+            filled += count;
+            data = data.subspan(count);
+            if (filled == chunk.size()) flush_chunk();
+        }
+    };
+    Filesystem::read_dir_entry_as_file(first, gather);
+    Filesystem::read_dir_entry_as_file(second, gather);
+    if (filled > 0) flush_chunk();
+
+    return newDirEntry;
 }
 
 void Filesystem::remove_dir_entry(uint parentCluster, uint position) {
+    auto operation = mJournal.operation();
     DirEntry toRemove;
 
-    mFileStream.seekg(mBS.mDataStartAddress + parentCluster * CLUSTER_SIZE);
-    auto dirEntryCount = Utils::read_from_stream<uint>(mFileStream);
+    uint bucketCluster = Filesystem::get_dir_buckets(parentCluster)[position / mBS.mMaxDirEntries];
+    auto data = mCache.read(bucketCluster);
+    toRemove.mount(data.data() + Filesystem::slot_offset(position % mBS.mMaxDirEntries));
 
-    mFileStream.seekp(position * toRemove.SIZE(), std::ios::cur);
-    toRemove.mount(mFileStream);
-
-    DirEntry lastDirEntry = Filesystem::get_dir_entry(parentCluster, false, true);
+    if (toRemove.mIsFile && Filesystem::is_open(parentCluster, toRemove.name())) {
+        std::cout << "File " << Utils::remove_padding(toRemove.mFilename) << " is opened" << std::endl;
+        return;
+    }
 
     // check if dir has anything beside '.' and '..'
     if (!toRemove.mIsFile && Filesystem::get_child_dir_entry_count(toRemove) > mTwoDirEntries) {
@@ -324,24 +1138,518 @@ void Filesystem::remove_dir_entry(uint parentCluster, uint position) {
         return;
     }
 
-    // delete dirEntry content in all clusters
-    auto clusters = Filesystem::get_cluster_locations(toRemove);
-    for (auto cluster : clusters) {
-        mFileStream.seekp(mBS.mDataStartAddress + cluster * CLUSTER_SIZE);
-        Utils::write_to_stream(mFileStream, mEmptyCluster);
+    if (!toRemove.mIsFile) {
+        for (uint bucket : Filesystem::get_dir_buckets(toRemove.mStartCluster)) mDentryCache.drop(bucket);
     }
 
-    // free FAT table
+    // free FAT table, the content is wiped once the group freeing it is committed
     mFAT.free_FAT(toRemove.mStartCluster);
-    mFileStream.seekp(mBS.mFatStartAddress);
-    mFAT.write_to_disk(mFileStream);
+    Filesystem::flush_fat();
+    if (!toRemove.mIsFile) mBucketCache.drop(toRemove.mStartCluster);
+
+    Filesystem::unlink_dir_entry(parentCluster, position);
+}
+
+void Filesystem::unlink_dir_entry(uint parentCluster, uint position) {
+    DirEntry removed, lastDirEntry;
+
+    uint bucketCluster = Filesystem::get_dir_buckets(parentCluster)[position / mBS.mMaxDirEntries];
+    uint slot = position % mBS.mMaxDirEntries;
+    auto data = mCache.read(bucketCluster);
+    uint dirEntryCount;
+    std::memcpy(&dirEntryCount, data.data(), sizeof(dirEntryCount));
+    removed.mount(data.data() + Filesystem::slot_offset(slot));
+    lastDirEntry.mount(data.data() + Filesystem::slot_offset(dirEntryCount - 1));
+
+    // change dirEntryCount and write the last entry of the bucket into the free space
+    Filesystem::write_bucket(bucketCluster, dirEntryCount - 1, slot, lastDirEntry);
+
+    // keep dentry cache in sync - the last entry took the slot of the removed one
+    mDentryCache.erase(bucketCluster, removed.name());
+    if (slot != dirEntryCount - 1) mDentryCache.insert(bucketCluster, Dentry{slot, lastDirEntry});
+
+    // shrink the parent dir if its last buckets got sparse
+    Filesystem::merge_dir_buckets(parentCluster);
+}
+
+bool Filesystem::move_dir_entry(uint sourceCluster, std::string_view name, uint targetCluster, const std::string& newName) {
+    auto operation = mJournal.operation();
+    if (name == "." || name == ".." || newName == "." || newName == "..") {
+        std::cout << "Cannot move " << name << std::endl;
+        return false;
+    }
+
+    auto dentry = Filesystem::find_dir_entry(name, Filesystem::get_dir_entry(sourceCluster, false, false));
+    if (!dentry) {
+        std::cout << name << " - not found" << std::endl;
+        return false;
+    }
+    DirEntry moved = dentry->dirEntry;
+
+    // a directory cannot be moved into itself or its subdirectory
+    if (!moved.mIsFile && Filesystem::is_inside(targetCluster, moved.mStartCluster)) {
+        std::cout << "Cannot move " << name << " into itself" << std::endl;
+        return false;
+    }
+
+    // check for existing filename in target dir
+    if (Filesystem::find_dir_entry(newName, Filesystem::get_dir_entry(targetCluster, false, false))) {
+        std::cout << newName << " already exists" << std::endl;
+        return false;
+    }
+
+    auto position = Filesystem::reserve_dir_slot(targetCluster, newName);
+    if (!position) {
+        std::cout << "Directory is full. Cannot move " << name << std::endl;
+        return false;
+    }
+
+    // link into target first - a crash leaves the DirEntry in both directories rather than in none
+    moved.mFilename = Utils::zero_padded_string(newName.substr(0, FILENAME_LEN), FILENAME_LEN);
+    Filesystem::insert_dir_entry(targetCluster, position.value(), moved);
+
+    // position is looked up again, a rename within a directory may have split its buckets
+    auto source = Filesystem::find_dir_entry(name, Filesystem::get_dir_entry(sourceCluster, false, false));
+    Filesystem::unlink_dir_entry(sourceCluster, source->position);
+
+    if (!moved.mIsFile && sourceCluster != targetCluster) {
+        DirEntry dotdot = Filesystem::get_dir_entry(targetCluster, false, false);
+        dotdot.mFilename = Utils::zero_padded_string("..", FILENAME_LEN);
+        Filesystem::write_dir_entry(moved.mStartCluster, 1, dotdot);    // '..' is always the second DirEntry
+    }
+
+    // opened files find their DirEntry by parent and name
+    for (auto& [_, openFile] : mOpenFiles) {
+        if (!Filesystem::is_same_file(openFile, sourceCluster, dentry->dirEntry.name())) continue;
+        openFile.parentCluster = targetCluster;
+        openFile.dirEntry.mFilename = moved.mFilename;
+    }
+    return true;
+}
+
+bool Filesystem::is_inside(uint dirCluster, uint ancestorCluster) {
+    while (dirCluster != ancestorCluster) {
+        if (dirCluster == 0) return false;  // reached the root
+        dirCluster = Filesystem::find_dir_entry("..", Filesystem::get_dir_entry(dirCluster, false, false))->dirEntry.mStartCluster;
+    }
+    return true;
+}
+
+void Filesystem::wipe_clusters(const std::vector<uint>& clusters) {
+    std::vector<char> zeros(std::min<size_t>(clusters.size(), mChunkClusters) * mBS.mClusterSize, '\0');
+    for (auto run : Utils::to_runs(clusters)) {
+        for (uint lower = run.lower; lower <= run.upper; lower += mChunkClusters) {
+            uint upper = std::min(run.upper, lower + mChunkClusters - 1);
+            mCache.write_run(Range{lower, upper}, zeros.data(), static_cast<size_t>(upper - lower + 1) * mBS.mClusterSize);
+        }
+    }
+}
+
+DefragReport Filesystem::defrag(uint maxFiles) {
+    auto operation = mJournal.operation();
+    DefragReport report{0, 0, 0, 0, 0};
+    Filesystem::defrag_dir(0, maxFiles, report);
+    return report;
+}
+
+void Filesystem::defrag_dir(uint dirCluster, uint maxFiles, DefragReport& report) {
+    auto dir = Filesystem::get_dir_entry(dirCluster, false, false);
+    auto dentries = Filesystem::read_dentries(dir);
+
+    for (auto& [position, dirEntry] : dentries) {
+        auto name = Utils::remove_padding(dirEntry.mFilename);
+        if (name == "." || name == "..") continue;
+
+        if (!dirEntry.mIsFile) {
+            Filesystem::defrag_dir(dirEntry.mStartCluster, maxFiles, report);
+            continue;
+        }
+
+        auto clusters = Filesystem::get_cluster_locations(dirEntry);
+        if (Utils::to_runs(clusters).size() <= 1) continue;
+
+        // opened files keep their clusters, shared clusters would get copied
+        bool movable = !Filesystem::is_open(dirCluster, dirEntry.name()) && !mFAT.is_shared(clusters.back());
+        bool underLimit = report.relocatedFiles + report.relocatedDirs < maxFiles;
+        if (underLimit && movable && Filesystem::relocate_file(dirCluster, position, dirEntry, clusters)) {
+            report.relocatedFiles++;
+            report.bytesMoved += clusters.size() * mBS.mClusterSize;
+        }
+        else report.fragmentedFiles++;
+    }
+
+    // buckets fragment like file chains, every run costs a transfer of Filesystem::read_buckets()
+    auto buckets = Filesystem::get_dir_buckets(dirCluster);
+    if (buckets.size() < 2 || Utils::to_runs({buckets.begin() + 1, buckets.end()}).size() <= 1) return;
+    bool underLimit = report.relocatedFiles + report.relocatedDirs < maxFiles;
+    if (underLimit && Filesystem::relocate_dir_buckets(dirCluster, buckets)) {
+        report.relocatedDirs++;
+        report.bytesMoved += (buckets.size() - 1) * mBS.mClusterSize;
+    }
+    else report.fragmentedDirs++;
+}
+
+bool Filesystem::relocate_dir_buckets(uint dirCluster, const std::vector<uint>& buckets) {
+    std::vector<uint> tail(buckets.begin() + 1, buckets.end());
+    Filesystem::reserve_free(tail.size());
+    int newStart = mFAT.allocate_extent(tail.size());
+    if (newStart == FAT::FLAG_NO_FREE_SPACE) return false;
+
+    // copy buckets into the new extent, it is not reachable until the FAT links it
+    std::vector<uint> extent(tail.size());
+    std::iota(extent.begin(), extent.end(), static_cast<uint>(newStart));
+    Filesystem::copy_clusters(tail, extent);
+
+    // switch the chain over to the copy and free the old buckets at once, they are wiped after the commit
+    mFAT.link(buckets.front(), newStart);
+    mFAT.free_FAT(tail.front());
+    Filesystem::flush_fat();
+    for (uint bucket : tail) mDentryCache.drop(bucket);
+    mBucketCache.drop(dirCluster);
+    return true;
+}
+
+bool Filesystem::relocate_file(uint parentCluster, uint position, DirEntry& file, const std::vector<uint>& clusters) {
+    Filesystem::reserve_free(clusters.size());
+    int newStart = mFAT.allocate_extent(clusters.size());
+    if (newStart == FAT::FLAG_NO_FREE_SPACE) return false;
+
+    // copy data into the new extent, run by run
+    std::vector<uint> extent(clusters.size());
+    std::iota(extent.begin(), extent.end(), static_cast<uint>(newStart));
+    Filesystem::copy_clusters(clusters, extent);
+
+    // new chain is complete -> point the DirEntry to it
+    Filesystem::flush_fat();
+    uint oldStart = file.mStartCluster;
+    file.mStartCluster = newStart;
+    Filesystem::write_dir_entry(parentCluster, position, file);
+
+    // free old chain, it is wiped once the new chain is committed
+    mFAT.free_FAT(oldStart);
+    Filesystem::flush_fat();
+    return true;
+}
+
+void Filesystem::update_dir_entry(uint parentCluster, const DirEntry& dirEntry) {
+    // position is looked up again, DirEntries move when buckets are split or merged
+    auto dentry = Filesystem::find_dir_entry(dirEntry.name(), Filesystem::get_dir_entry(parentCluster, false, false));
+    if (dentry) Filesystem::write_dir_entry(parentCluster, dentry->position, dirEntry);
+}
 
-    // change dirEntryCount and write the last entry of parent dir into the free space
-    dirEntryCount--;
-    mFileStream.seekp(mBS.mDataStartAddress + parentCluster * CLUSTER_SIZE);
-    Utils::write_to_stream(mFileStream, dirEntryCount);
-    mFileStream.seekp(position * toRemove.SIZE(), std::ios::cur);
-    lastDirEntry.write_to_disk(mFileStream);
+std::optional<FileHandle> Filesystem::open(uint parentCluster, std::string_view name) {
+    auto dentry = Filesystem::find_dir_entry(name, Filesystem::get_dir_entry(parentCluster, false, false));
+    if (!dentry) {
+        std::cout << name << " - not found" << std::endl;
+        return std::nullopt;
+    }
+    if (!dentry->dirEntry.mIsFile) {
+        std::cout << name << " is a directory" << std::endl;
+        return std::nullopt;
+    }
+
+    FileHandle handle = mNextHandle++;
+    mOpenFiles[handle] = OpenFile{parentCluster, dentry->dirEntry, 0, 0, dentry->dirEntry.mStartCluster};
+    return handle;
+}
+
+OpenFile* Filesystem::get_open_file(FileHandle handle) {
+    auto it = mOpenFiles.find(handle);
+    if (it != mOpenFiles.end()) return &it->second;
+
+    std::cout << "Invalid file handle: " << handle << std::endl;
+    return nullptr;
+}
+
+bool Filesystem::is_same_file(const OpenFile& file, uint parentCluster, std::string_view name) {
+    return file.parentCluster == parentCluster && file.dirEntry.name() == name.substr(0, FILENAME_LEN);
+}
+
+bool Filesystem::is_open(uint parentCluster, std::string_view name) const {
+    return std::any_of(mOpenFiles.begin(), mOpenFiles.end(), [parentCluster, name](const auto& openFile) {
+        return Filesystem::is_same_file(openFile.second, parentCluster, name);
+    });
+}
+
+void Filesystem::copy_clusters(const std::vector<uint>& from, const std::vector<uint>& to) {
+    // a chunk is gathered from the runs of the source and scattered into the runs of the target
+    std::vector<char> chunk(std::min<size_t>(from.size(), mChunkClusters) * mBS.mClusterSize);
+    for (size_t done = 0; done < from.size(); done += mChunkClusters) {
+        size_t count = std::min<size_t>(from.size() - done, mChunkClusters);
+
+        size_t offset = 0;
+        for (auto run : Utils::to_runs({from.begin() + done, from.begin() + done + count})) {
+            mCache.read_run(run, chunk.data() + offset);
+            offset += static_cast<size_t>(run.upper - run.lower + 1) * mBS.mClusterSize;
+        }
+        offset = 0;
+        for (auto run : Utils::to_runs({to.begin() + done, to.begin() + done + count})) {
+            size_t size = static_cast<size_t>(run.upper - run.lower + 1) * mBS.mClusterSize;
+            mCache.write_run(run, chunk.data() + offset, size);
+            offset += size;
+        }
+    }
+}
+
+std::vector<uint> Filesystem::private_clusters(std::vector<uint> clusters) const {
+    // shared clusters form a suffix of the chain
+    auto shared = std::find_if(clusters.begin(), clusters.end(), [this](uint cluster) { return mFAT.is_shared(cluster); });
+    clusters.erase(shared, clusters.end());
+    return clusters;
+}
+
+bool Filesystem::unshare_clusters(OpenFile& file, uint lastIndex) {
+    auto clusters = Filesystem::get_cluster_locations(file.dirEntry);
+    lastIndex = std::min<uint>(lastIndex, clusters.size() - 1);
+    uint first = Filesystem::private_clusters(clusters).size();
+    if (first > lastIndex) return true;
+
+    // copy the shared clusters up to lastIndex into a new chain, the rest of the chain stays shared
+    uint count = lastIndex - first + 1;
+    Filesystem::reserve_free(count);
+    int newStart = mFAT.allocate(static_cast<size_t>(count) * mBS.mClusterSize);
+    if (newStart == FAT::FLAG_NO_FREE_SPACE) {
+        std::cout << "FAT table is full. Cannot copy shared clusters of " << file.dirEntry.name() << std::endl;
+        return false;
+    }
+    DirEntry copy;
+    copy.mStartCluster = newStart;
+    auto copies = Filesystem::get_cluster_locations(copy);
+    std::vector<uint> shared(clusters.begin() + first, clusters.begin() + lastIndex + 1);
+    Filesystem::copy_clusters(shared, copies);
+
+    // link the copies in place of the shared clusters, which lose a reference of this file
+    mFAT.link(copies.back(), (lastIndex + 1 < clusters.size()) ? static_cast<int>(clusters[lastIndex + 1]) : FAT::FLAG_FILE_END);
+    if (first > 0) mFAT.link(clusters[first - 1], newStart);
+    Filesystem::flush_fat();
+    for (auto cluster : shared) {
+        mFAT.drop_reference(cluster);
+    }
+
+    // a new start cluster has to be saved, all handles of the file walk the new chain
+    if (first == 0) {
+        file.dirEntry.mStartCluster = newStart;
+        Filesystem::update_dir_entry(file.parentCluster, file.dirEntry);
+    }
+    for (auto& [_, openFile] : mOpenFiles) {
+        if (!Filesystem::is_same_file(openFile, file.parentCluster, file.dirEntry.name())) continue;
+        openFile.dirEntry.mStartCluster = file.dirEntry.mStartCluster;
+        openFile.cursorIndex = 0;
+        openFile.cursorCluster = file.dirEntry.mStartCluster;
+    }
+    file.cursorIndex = 0;
+    file.cursorCluster = file.dirEntry.mStartCluster;
+    return true;
+}
+
+uint Filesystem::locate_cluster(OpenFile& file, uint index) {
+    if (index < file.cursorIndex) {
+        file.cursorIndex = 0;
+        file.cursorCluster = file.dirEntry.mStartCluster;
+    }
+    while (file.cursorIndex < index) {
+        file.cursorCluster = mFAT.table[file.cursorCluster];
+        file.cursorIndex++;
+    }
+    return file.cursorCluster;
+}
+
+uint Filesystem::run_length(uint cluster, uint maxClusters) const {
+    uint count = 1;
+    while (count < maxClusters && mFAT.table[cluster + count - 1] == static_cast<int>(cluster + count)) count++;
+    return count;
+}
+
+size_t Filesystem::extend_file(OpenFile& file, size_t end) {
+    uint allocated = mFAT.cluster_count(file.dirEntry.mSize);
+    uint needed = mFAT.cluster_count(end);
+    if (needed <= allocated) return end;
+
+    // new clusters are already wiped, so the file never exposes stale data
+    Filesystem::reserve_free(needed - allocated);
+    uint added = std::min(needed - allocated, mFAT.free_count());
+    uint tail = Filesystem::locate_cluster(file, allocated - 1);
+    for (uint i = 0; i < added; ++i) {
+        tail = mFAT.append(tail);
+    }
+    Filesystem::flush_fat();
+    return std::min<size_t>(end, static_cast<size_t>(allocated + added) * mBS.mClusterSize);
+}
+
+size_t Filesystem::read(FileHandle handle, char* data, size_t size) {
+    OpenFile* file = Filesystem::get_open_file(handle);
+    if (file == nullptr) return 0;
+
+    const uint clusterSize = mBS.mClusterSize;
+    size = std::min<size_t>(size, file->dirEntry.mSize - file->offset);
+    std::vector<char> bounce{};
+    size_t done = 0;
+    while (done < size) {
+        uint cluster = Filesystem::locate_cluster(*file, file->offset / clusterSize);
+        size_t skip = file->offset % clusterSize;
+        size_t remaining = size - done;
+        size_t count;
+
+        if (skip != 0 || remaining < clusterSize) {
+            // part of a cluster -> through a bounce buffer
+            count = std::min<size_t>(remaining, clusterSize - skip);
+            bounce.resize(clusterSize);
+            mCache.read_run(Range{cluster, cluster}, bounce.data());
+            std::memcpy(data + done, bounce.data() + skip, count);
+        }
+        else {
+            // whole clusters -> a run of adjacent ones straight into the caller's buffer
+            uint runLength = Filesystem::run_length(cluster, std::min<size_t>(remaining / clusterSize, mChunkClusters));
+            count = static_cast<size_t>(runLength) * clusterSize;
+            mCache.read_run(Range{cluster, cluster + runLength - 1}, data + done);
+        }
+        done += count;
+        file->offset += count;
+    }
+    return done;
+}
+
+size_t Filesystem::write(FileHandle handle, const char* data, size_t size) {
+    auto operation = mJournal.operation();
+    OpenFile* file = Filesystem::get_open_file(handle);
+    if (file == nullptr) return 0;
+
+    // size of a file is 32-bit, a full disk cuts the write short
+    const uint clusterSize = mBS.mClusterSize;
+    size = std::min<size_t>(size, UINT_MAX - file->offset);
+    if (size == 0) return 0;
+
+    // written clusters (and the last one, if the file grows) must not be shared with another file
+    if (!Filesystem::unshare_clusters(*file, (file->offset + size - 1) / clusterSize)) return 0;
+    size = Filesystem::extend_file(*file, file->offset + size) - file->offset;
+    size_t done = 0;
+    while (done < size) {
+        uint cluster = Filesystem::locate_cluster(*file, file->offset / clusterSize);
+        size_t skip = file->offset % clusterSize;
+        size_t remaining = size - done;
+        size_t count;
+
+        if (skip != 0 || remaining < clusterSize) {
+            count = std::min<size_t>(remaining, clusterSize - skip);
+            mCache.write(cluster, skip, data + done, count);
+        }
+        else {
+            uint runLength = Filesystem::run_length(cluster, std::min<size_t>(remaining / clusterSize, mChunkClusters));
+            count = static_cast<size_t>(runLength) * clusterSize;
+            mCache.write_run(Range{cluster, cluster + runLength - 1}, data + done, count);
+        }
+        done += count;
+        file->offset += count;
+    }
+
+    // file grew -> save its new size, other handles of the same file see it too
+    if (file->offset > file->dirEntry.mSize) {
+        file->dirEntry.mSize = file->offset;
+        Filesystem::update_dir_entry(file->parentCluster, file->dirEntry);
+        for (auto& [_, openFile] : mOpenFiles) {
+            if (Filesystem::is_same_file(openFile, file->parentCluster, file->dirEntry.name())) openFile.dirEntry.mSize = file->offset;
+        }
+    }
+    return done;
+}
+
+std::optional<size_t> Filesystem::lseek(FileHandle handle, long offset, SeekOrigin origin) {
+    OpenFile* file = Filesystem::get_open_file(handle);
+    if (file == nullptr) return std::nullopt;
+
+    long base = 0;
+    if (origin == SeekOrigin::CUR) base = static_cast<long>(file->offset);
+    else if (origin == SeekOrigin::END) base = file->dirEntry.mSize;
+
+    long position = base + offset;
+    if (position < 0 || position > file->dirEntry.mSize) {
+        std::cout << "Invalid seek: " << position << " is outside of the file" << std::endl;
+        return std::nullopt;
+    }
+    file->offset = position;
+    return file->offset;
+}
+
+bool Filesystem::close(FileHandle handle) {
+    if (Filesystem::get_open_file(handle) == nullptr) return false;
+    mOpenFiles.erase(handle);
+    return true;
+}
+
+std::optional<size_t> Filesystem::append(uint parentCluster, std::string_view name, std::string_view content) {
+    auto operation = mJournal.operation();
+    auto handle = Filesystem::open(parentCluster, name);
+    if (!handle) return std::nullopt;
+
+    // check for free space first, so the file is never appended partially - shared clusters get copied too
+    OpenFile* file = Filesystem::get_open_file(handle.value());
+    size_t end = static_cast<size_t>(file->dirEntry.mSize) + content.size();
+    auto clusters = Filesystem::get_cluster_locations(file->dirEntry);
+    uint needed = mFAT.cluster_count(end) - mFAT.cluster_count(file->dirEntry.mSize)
+                  + clusters.size() - Filesystem::private_clusters(clusters).size();
+    if (end > UINT_MAX || !Filesystem::reserve_free(needed)) {
+        std::cout << "FAT table is full. Cannot append to " << name << std::endl;
+        Filesystem::close(handle.value());
+        return std::nullopt;
+    }
+
+    // writing at the end fills the last cluster and links new ones, see Filesystem::write()
+    Filesystem::lseek(handle.value(), 0, SeekOrigin::END);
+    Filesystem::write(handle.value(), content.data(), content.size());
+    Filesystem::close(handle.value());
+    return end;
+}
+
+bool Filesystem::truncate(uint parentCluster, std::string_view name, size_t size) {
+    auto operation = mJournal.operation();
+    auto dentry = Filesystem::find_dir_entry(name, Filesystem::get_dir_entry(parentCluster, false, false));
+    if (!dentry) {
+        std::cout << name << " - not found" << std::endl;
+        return false;
+    }
+    if (!dentry->dirEntry.mIsFile) {
+        std::cout << name << " is a directory" << std::endl;
+        return false;
+    }
+    if (Filesystem::is_open(parentCluster, dentry->dirEntry.name())) {
+        std::cout << "File " << name << " is opened" << std::endl;
+        return false;
+    }
+
+    // the file is walked like an opened one, without registering a handle
+    OpenFile file{parentCluster, dentry->dirEntry, 0, 0, dentry->dirEntry.mStartCluster};
+    const uint clusterSize = mBS.mClusterSize;
+    uint allocated = mFAT.cluster_count(file.dirEntry.mSize);
+    uint needed = mFAT.cluster_count(size);
+
+    if (needed > allocated) {
+        if (size > UINT_MAX || !Filesystem::reserve_free(needed - allocated)) {
+            std::cout << "FAT table is full. Cannot extend " << name << std::endl;
+            return false;
+        }
+        if (!Filesystem::unshare_clusters(file, allocated - 1)) return false;
+        Filesystem::extend_file(file, size);
+    }
+    else if (size < file.dirEntry.mSize) {
+        if (!Filesystem::unshare_clusters(file, needed - 1)) return false;
+        uint lastCluster = Filesystem::locate_cluster(file, needed - 1);
+
+        // free clusters are kept wiped, so is the cut off part of the last cluster
+        size_t lastStart = static_cast<size_t>(needed - 1) * clusterSize;
+        size_t slackEnd = std::min<size_t>(clusterSize, file.dirEntry.mSize - lastStart);
+        if (size - lastStart < slackEnd) {
+            std::vector<char> zeros(slackEnd - (size - lastStart), '\0');
+            mCache.write(lastCluster, size - lastStart, zeros.data(), zeros.size());
+        }
+        if (needed < allocated) {
+            mFAT.truncate(lastCluster);
+            Filesystem::flush_fat();
+        }
+    }
+
+    file.dirEntry.mSize = size;
+    Filesystem::write_dir_entry(parentCluster, dentry->position, file.dirEntry);
+    return true;
 }
 
 std::vector<uint> Filesystem::get_cluster_locations(const DirEntry& dirEntry) {
@@ -362,35 +1670,63 @@ void Filesystem::init_default_files() {
     Filesystem::create_dir_entry(3, "thesis.txt", true, "As expected, the random sampling method has the worst result, with several points overlapping and being too close to each other. The Poisson disk sampling does not have a problem with overlapping points but due to its random nature, the polygon is populated non-uniformly. The k-means method yields the best results with all points being distributed evenly across the whole polygon.");
 }
 
+std::vector<Dentry> Filesystem::read_dentries(const DirEntry& dirEntry) {
+    if (dirEntry.mIsFile) throw std::runtime_error("Cannot get child dirEntries of a file");
+
+    std::vector<Dentry> result{};
+    Filesystem::read_buckets(dirEntry.mStartCluster, [this, &result](uint bucket, const char* data) {
+        uint count;
+        std::memcpy(&count, data, sizeof(count));
+
+        // decode DirEntries straight from the bucket buffer by their offsets
+        for (uint i = 0; i < count; ++i) {
+            auto& dentry = result.emplace_back(Dentry{bucket * mBS.mMaxDirEntries + i, DirEntry{}});
+            dentry.dirEntry.mount(data + Filesystem::slot_offset(i));
+        }
+    });
+    return result;
+}
+
 std::vector<DirEntry> Filesystem::read_dir_entry_as_dir(const DirEntry& dirEntry) {
+    if (dirEntry.mIsFile) throw std::runtime_error("Cannot get child dirEntries of a file");
+
     std::vector<DirEntry> result{};
-    uint dirEntryCount = Filesystem::get_child_dir_entry_count(dirEntry);
+    Filesystem::read_buckets(dirEntry.mStartCluster, [&result](uint, const char* data) {
+        uint count;
+        std::memcpy(&count, data, sizeof(count));
 
-    DirEntry tmp;
-    while (dirEntryCount > 0) {
-        tmp.mount(mFileStream);
-        result.emplace_back(tmp);
-        dirEntryCount--;
-    }
+        size_t first = result.size();
+        result.resize(first + count);
+        DirEntry::Layout::decode_all(std::span<DirEntry>{result}.subspan(first), data + Filesystem::slot_offset(0));
+    });
     return result;
 }
 
 std::string Filesystem::read_dir_entry_as_file(const DirEntry& dirEntry) {
     std::string content{};
+    content.reserve(dirEntry.mSize);
 
-    long long int idx = dirEntry.mStartCluster;
-    long long int readSize = dirEntry.mSize;
-    do {
-        mFileStream.seekp(mBS.mDataStartAddress + idx * CLUSTER_SIZE);
-        if (readSize <= CLUSTER_SIZE) {
-            content += Utils::string_from_stream(mFileStream, readSize);
-            break;
-        }
-        else {
-            content += Utils::string_from_stream(mFileStream, CLUSTER_SIZE);
-            idx = mFAT.table[idx];
-            readSize -= CLUSTER_SIZE;
-        }
-    } while (idx != FAT::FLAG_FILE_END);
+    Filesystem::read_dir_entry_as_file(dirEntry, [&content](std::span<const char> chunk) {
+        content.append(chunk.data(), chunk.size());
+    });
     return content;
+}
+
+void Filesystem::read_dir_entry_as_file(const DirEntry& dirEntry, const ChunkConsumer& consumer) {
+    if (dirEntry.mSize == 0) return;
+
+    // adjacent clusters are merged into runs, each run (or its chunk) is read at once
+    size_t chunkCapacity = static_cast<size_t>(mChunkClusters) * mBS.mClusterSize;
+    std::vector<char> chunk(std::min<size_t>(dirEntry.mSize + mBS.mClusterSize, chunkCapacity));
+    size_t readSize = dirEntry.mSize;
+    for (auto run : Utils::to_runs(Filesystem::get_cluster_locations(dirEntry))) {
+        for (uint lower = run.lower; lower <= run.upper && readSize > 0; lower += mChunkClusters) {
+            uint upper = std::min(run.upper, lower + mChunkClusters - 1);
+            mCache.read_run(Range{lower, upper}, chunk.data());
+
+            size_t chunkSize = std::min<size_t>(readSize, static_cast<size_t>(upper - lower + 1) * mBS.mClusterSize);
+            consumer(std::span<const char>{chunk.data(), chunkSize});
+            readSize -= chunkSize;
+        }
+    }
 }
\ No newline at end of file
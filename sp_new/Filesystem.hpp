@@ -1,9 +1,23 @@
 #pragma once
 
-#include <fstream>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <list>
 #include <optional>
+#include <string_view>
+#include <unordered_map>
+#include "Disk.hpp"
+#include "Cache.hpp"
+#include "Journal.hpp"
+#include "Mirror.hpp"
+#include "Layout.hpp"
 #include "Utils.hpp"
 
+using ChunkConsumer = std::function<void (std::span<const char>)>;
+using BucketConsumer = std::function<void (uint, const char*)>;
+using FatRunConsumer = std::function<void (uint, std::span<const int>)>;
+
 /**
  * Class BootSector - contains the basic info about the filesystem.
  */
@@ -15,33 +29,81 @@ class BootSector {
         uint mClusterCount;         // total number of clusters
         uint mFatStartAddress;      // start address of FAT
         uint mDataStartAddress;     // start address of data blocks
-        uint mMaxDirEntries;        // max number of dirEntries in a dir cluster
+        uint mMaxDirEntries;        // max number of dirEntries in a dir cluster (bucket)
 
-        [[nodiscard]] uint SIZE() const {
-            return SIGNATURE_LEN + Utils::sum_sizeof(mDiskSize, mClusterSize, mClusterCount,
-                                                     mFatStartAddress, mDataStartAddress, mMaxDirEntries);
-        }
+        // on-disk layout, in order of fields
+        using Layout = RecordLayout<FixedString<&BootSector::mSignature, SIGNATURE_LEN>,
+                                    Scalar<&BootSector::mDiskSize>, Scalar<&BootSector::mClusterSize>,
+                                    Scalar<&BootSector::mClusterCount>, Scalar<&BootSector::mFatStartAddress>,
+                                    Scalar<&BootSector::mDataStartAddress>, Scalar<&BootSector::mMaxDirEntries>>;
+
+        static constexpr uint SIZE() { return Layout::SIZE; }
 
         BootSector() = default;
         ~BootSector() = default;
 
+    private:
+        static constexpr uint align_block(uint address) {
+            return (address + Journal::BLOCK_SIZE - 1) / Journal::BLOCK_SIZE * Journal::BLOCK_SIZE;
+        }
+
+        /**
+         * Method returns the size of the regions between FAT and data blocks (FAT2, journal).
+         * They are not stored, their sizes follow from the disk size, see BootSector::init().
+         * @return size in bytes
+         */
+        [[nodiscard]] uint reserved_size() const {
+            uint start = align_block(mFatStartAddress + mClusterCount * sizeof(uint));
+            return (mDataStartAddress > start) ? mDataStartAddress - start : 0;
+        }
+
+    public:
         /**
          * The de-facto constructor.
          * @param diskSize to be initialized to
+         * @param clusterSize size of one cluster, see Utils::is_valid_cluster_size()
+         * @param fatMirror true to reserve room for FAT2
+         */
+        void init(uint diskSize, uint clusterSize, bool fatMirror = false);
+
+        /**
+         * Method returns the start address of FAT2, the first block after FAT.
+         * @return address or 0 if the disk has no FAT2
          */
-        void init(uint diskSize);
+        [[nodiscard]] uint fat2_start_address() const {
+            uint fatSpan = align_block(mClusterCount * sizeof(uint));
+            bool hasFat2 = BootSector::reserved_size() == Journal::size_for(mDiskSize) + fatSpan;
+            return hasFat2 ? align_block(mFatStartAddress + mClusterCount * sizeof(uint)) : 0;
+        }
+
+        /**
+         * Method returns the start address of the journal region, the first block after FAT (or FAT2).
+         * @return address
+         */
+        [[nodiscard]] uint journal_start_address() const {
+            return mDataStartAddress - BootSector::journal_size();
+        }
+
+        /**
+         * Method returns the size of the journal region, it lies right before data blocks.
+         * @return size in bytes, 0 if the disk has no journal
+         */
+        [[nodiscard]] uint journal_size() const {
+            uint fatSpan = (BootSector::fat2_start_address() != 0) ? align_block(mClusterCount * sizeof(uint)) : 0;
+            return BootSector::reserved_size() - fatSpan;
+        }
 
         /**
          * Loads BootSector from a file.
          * @param stream
          */
-        void mount(std::fstream& stream);
+        void mount(Disk& stream);
 
         /**
          * Method saves BootSector data to file.
          * @param stream
          */
-        void write_to_disk(std::fstream& stream);
+        void write_to_disk(Disk& stream);
 };
 
 /**
@@ -53,10 +115,67 @@ class FAT {
         static constexpr int FLAG_FILE_END = -2;
         static constexpr int FLAG_BAD_CLUSTER = -3;
         static constexpr int FLAG_NO_FREE_SPACE = -4;
+        static constexpr uint PAGE_ENTRIES = 512_B / sizeof(int);    // FAT entries per dirty page
+
+        /**
+         * Enum class AllocationMode - how clusters of a new file are chosen.
+         * NEXT_FIT takes free clusters one by one from the next-fit cursor.
+         * CONTIGUOUS looks for a single free extent first (best-fit), then for the fewest fragments.
+         */
+        enum class AllocationMode { NEXT_FIT, CONTIGUOUS };
 
+    private:
+        std::vector<uint64_t> mFreeBitmap;  // one bit per cluster, set -> cluster is free
+        uint mFreeCount;                    // number of set bits in mFreeBitmap
+        uint mNextFit;                      // next-fit cursor, allocation search starts here
+        std::vector<bool> mDirtyPages;      // FAT pages changed since the last flush
+        std::unordered_map<uint, uint> mShares;    // cluster -> references beyond the first, only shared clusters
+        std::vector<uint> mFreed;           // freed since the last flush, still used in mFreeBitmap
+        std::vector<uint> mReleasable;      // freed and flushed, free once the flush is durable
+        uint mClusterSize = DEFAULT_CLUSTER_SIZE;
+        AllocationMode mAllocationMode = AllocationMode::CONTIGUOUS;
+
+        /**
+         * Method sets a FAT entry and keeps the free cluster bitmap in sync.
+         * @param idx index of FAT entry
+         * @param value new value of FAT entry
+         */
+        void set_entry(uint idx, int value);
+
+        /**
+         * Method frees a FAT entry, but not its cluster. It cannot be allocated until it is released,
+         * see FAT::take_releasable().
+         * @param idx index of FAT entry
+         */
+        void free_entry(uint idx);
+
+        [[nodiscard]] bool is_free(uint idx) const { return (mFreeBitmap[idx / 64] >> (idx % 64)) & 1; }
+
+        /**
+         * Method rebuilds the free cluster bitmap from the FAT table.
+         */
+        void rebuild_free_bitmap();
+
+        /**
+         * Method links the first clusterCount clusters of extents into one chain.
+         * @param extents to be linked, in order
+         * @param clusterCount number of clusters to be linked
+         */
+        void link_extents(const std::vector<Range>& extents, uint clusterCount);
+
+        /**
+         * Method finds the smallest extent that can hold clusterCount clusters.
+         * @param extents to be searched
+         * @param clusterCount number of clusters needed
+         * @return best fitting extent or std::nullopt
+         */
+        static std::optional<Range> best_fit(const std::vector<Range>& extents, uint clusterCount);
+
+    public:
         // FAT table
         std::vector<int> table;
         [[nodiscard]] uint SIZE() const { return table.size() * sizeof(uint); }
+        [[nodiscard]] uint free_count() const { return mFreeCount; }
 
         FAT() = default;
         ~FAT() = default;
@@ -64,20 +183,43 @@ class FAT {
         /**
          * The de-facto constructor.
          * @param fatEntryCount
+         * @param clusterSize size of one cluster
          */
-        void init(uint fatEntryCount);
+        void init(uint fatEntryCount, uint clusterSize);
 
         /**
          * Loads FAT from a file.
          * @param stream
          */
-        void mount(std::fstream& stream);
+        void mount(Disk& stream);
 
         /**
-         * Writes FAT entries to file.
+         * Writes all FAT entries to file.
          * @param stream
          */
-        void write_to_disk(std::fstream& stream);
+        void write_to_disk(Disk& stream);
+
+        /**
+         * Writes only the FAT pages changed since the last flush. Adjacent dirty pages are written at once.
+         * @param stream to be written into
+         * @param fatStartAddress start address of FAT on disk
+         * @param consumer called for every written run with its first entry, e.g. to mirror it
+         */
+        void flush(Disk& stream, uint fatStartAddress, const FatRunConsumer& consumer = nullptr);
+
+        /**
+         * Method replaces the whole table, e.g. by its mirror. All pages become dirty.
+         * @param entries new FAT entries, same count as the table
+         */
+        void restore(const std::vector<int>& entries);
+
+        /**
+         * Method checks that all entries are flags or cluster indices, and the root cluster is used.
+         * @param entries FAT entries to be checked
+         * @return true if valid, else false
+         */
+        static bool is_valid(std::span<const int> entries);
+
 
         /**
          * Method modifies the FAT table.
@@ -88,13 +230,114 @@ class FAT {
         bool write_FAT(uint idx, size_t fileSize);
 
         /**
-         * Method frees the FAT table starting from index idx.
+         * Method allocates a cluster chain for a new file according to the allocation mode.
+         * Nothing is changed if there is not enough free space.
+         * @param fileSize of to-be-created file
+         * @return first cluster of the chain or FLAG_NO_FREE_SPACE
+         */
+        int allocate(size_t fileSize);
+
+        /**
+         * Method allocates a chain of clusterCount clusters in a single free extent (best-fit).
+         * Nothing is changed if there is no free extent big enough.
+         * @param clusterCount number of clusters of the chain
+         * @return first cluster of the chain or FLAG_NO_FREE_SPACE
+         */
+        int allocate_extent(uint clusterCount);
+
+        /**
+         * Method returns all free extents (runs of free clusters) in the order of the table.
+         * @return free extents, bounds inclusive
+         */
+        [[nodiscard]] std::vector<Range> free_extents() const;
+
+        /**
+         * Method returns the number of clusters needed for a file.
+         * @param fileSize size of file
+         * @return number of clusters, at least one
+         */
+        [[nodiscard]] uint cluster_count(size_t fileSize) const {
+            return (fileSize <= mClusterSize) ? 1 : (fileSize + mClusterSize - 1) / mClusterSize;
+        }
+
+        void set_allocation_mode(AllocationMode mode) { mAllocationMode = mode; }
+        [[nodiscard]] AllocationMode allocation_mode() const { return mAllocationMode; }
+
+        /**
+         * Method appends a free cluster to a chain, preferably the one right after its last cluster.
+         * @param lastCluster last cluster of the chain
+         * @return appended cluster or FLAG_NO_FREE_SPACE
+         */
+        int append(uint lastCluster);
+
+        /**
+         * Method frees all clusters of a chain after a given cluster, which becomes the end of the chain.
+         * @param lastCluster new last cluster of the chain
+         */
+        void truncate(uint lastCluster);
+
+        /**
+         * Method returns the clusters freed by flushed FAT pages, they are forgotten by FAT.
+         * Until FAT::release() they stay unavailable, e.g. until the journal commits the flush.
+         * @return freed clusters
+         */
+        std::vector<uint> take_releasable();
+
+        /**
+         * Method makes freed clusters available for allocation.
+         * @param clusters taken by FAT::take_releasable()
+         */
+        void release(const std::vector<uint>& clusters);
+
+        /**
+         * Method returns the number of freed clusters, which are not released yet.
+         * @return number of clusters
+         */
+        [[nodiscard]] size_t unreleased_count() const { return mFreed.size() + mReleasable.size(); }
+
+        /**
+         * Method frees the FAT table starting from index idx. Shared clusters are not freed,
+         * they only lose a reference. Freed clusters have to be released, see FAT::take_releasable().
          * @param idx index to start freeing from
          */
         void free_FAT(uint idx);
 
         /**
-         * Method finds a free index in the FAT table.
+         * Method adds a reference to every cluster of a chain, so one more file can use it.
+         * Chains only ever merge, so the shared clusters of a chain always form its suffix.
+         * @param idx first cluster of the chain
+         */
+        void share(uint idx);
+
+        /**
+         * Method adds a reference to a single cluster.
+         * @param idx index of cluster
+         */
+        void add_reference(uint idx) { mShares[idx]++; }
+
+        /**
+         * Method removes a reference from a shared cluster.
+         * @param idx index of cluster
+         */
+        void drop_reference(uint idx);
+
+        /**
+         * Method checks if a cluster is used by more than one file.
+         * @param idx index of cluster
+         * @return true if shared, else false
+         */
+        [[nodiscard]] bool is_shared(uint idx) const { return mShares.contains(idx); }
+
+        /**
+         * Method points a cluster to the next cluster of its chain.
+         * @param idx index of cluster
+         * @param next cluster or FLAG_FILE_END
+         */
+        void link(uint idx, int next) { FAT::set_entry(idx, next); }
+
+        /**
+         * Method finds a free index in the FAT table. Uses the free cluster bitmap
+         * and a next-fit cursor, so the search costs O(1) amortized.
          * @param ignoredIdx index to be ignored even if it's free.
          * @return free index or some FLAG
          */
@@ -111,17 +354,38 @@ class FAT {
 class DirEntry {
     public:
         std::string mFilename;  // 7 + 1 + 3 + \0
-        bool mIsFile;           // true -> is file, false -> is dir
-        uint mSize;             // file size
-        uint mStartCluster;     // first cluster of file
+        bool mIsFile = false;   // true -> is file, false -> is dir
+        uint mSize = 0;         // file size
+        uint mStartCluster = 0; // first cluster of file
+
+        // on-disk layout, in order of fields
+        using Layout = RecordLayout<FixedString<&DirEntry::mFilename, FILENAME_LEN>, Scalar<&DirEntry::mIsFile>,
+                                    Scalar<&DirEntry::mSize>, Scalar<&DirEntry::mStartCluster>>;
+
+        static constexpr uint SIZE() { return Layout::SIZE; }
 
-        [[nodiscard]] uint SIZE() const {
-            return FILENAME_LEN + Utils::sum_sizeof(mIsFile, mSize, mStartCluster);
+        /**
+         * Method returns the filename of an encoded DirEntry without decoding it.
+         * @param data encoded DirEntry
+         * @return view of the filename without padding, valid while data lives
+         */
+        static std::string_view raw_name(const char* data) {
+            const char* name = data + Layout::OFFSETS[0];
+            return std::string_view{name, strnlen(name, FILENAME_LEN)};
         }
 
         DirEntry() = default;
         ~DirEntry() = default;
 
+        /**
+         * Method returns the filename without padding, no copy is made.
+         * @return view of the filename, valid while the DirEntry lives
+         */
+        [[nodiscard]] std::string_view name() const {
+            std::string_view name{mFilename};
+            return name.substr(0, name.find('\0'));
+        }
+
         /**
          * Overloaded operator bool().
          * @return true if dirEntry is valid, otherwise false
@@ -138,58 +402,612 @@ class DirEntry {
         void init(const std::string& filename, bool isFile, uint size, uint startCLuster);
 
         /**
-         * Load DirEntry from file.
-         * @param stream to be loaded from
+         * Load DirEntry from a buffer.
+         * @param data buffer of at least SIZE() bytes to be loaded from
          */
-        void mount(std::fstream& stream);
+        void mount(const char* data);
 
         /**
-         * Method saves DirEntry info to file.
-         * @param stream to be written into
+         * Method saves DirEntry info into a buffer.
+         * @param data buffer of at least SIZE() bytes to be written into
          */
-        void write_to_disk(std::fstream& stream);
+        void write_to_buffer(char* data) const;
 
         /**
-         * Method save contents of a DirEntry into a file.
-         * @param stream to be written into.
-         * @param dataStartAddress of DirEntry
+         * Method save contents of a DirEntry into data clusters. Runs of adjacent clusters are written
+         * directly from content, one disk write per run.
+         * @param cache cluster cache to be written through
          * @param clusters of DirEntry
          * @param content of DirEntry
          */
-        void write_content_to_disk(std::fstream& stream, uint dataStartAddress, const std::vector<uint>& clusters , const std::string& content) const;
+        void write_content_to_disk(ClusterCache& cache, const std::vector<uint>& clusters, std::string_view content) const;
     };
 
+// any change of the on-disk format has to be done on purpose
+static_assert(BootSector::SIZE() == 33, "BootSector layout changed");
+static_assert(BootSector::Layout::OFFSETS[1] == SIGNATURE_LEN, "BootSector layout changed");
+static_assert(DirEntry::SIZE() == 22, "DirEntry layout changed");
+static_assert(DirEntry::Layout::OFFSETS == std::array<size_t, 4>{0, 13, 14, 18}, "DirEntry layout changed");
+static_assert(sizeof(int) == 4, "FAT entries are 32-bit");
+
+/**
+ * Structure Dentry - a DirEntry together with its position in the parent directory.
+ */
+struct Dentry {
+    uint position;
+    DirEntry dirEntry;
+};
+
+/**
+ * Class DirIndex - open addressing (linear probing) hash map from filename to Dentry of one bucket.
+ * Positions of its Dentries are slots inside of the bucket.
+ */
+class DirIndex {
+    private:
+        /**
+         * Structure Slot - one slot of the hash map.
+         */
+        struct Slot {
+            bool used;
+            size_t hash;
+            Dentry dentry;
+        };
+
+        std::vector<Slot> mSlots;   // size is always a power of two
+        size_t mCount;
+
+        /**
+         * Method returns the index of the slot holding a name, or of the empty slot ending its probe sequence.
+         * @param name to be searched for
+         * @param hash of name
+         * @return index of slot
+         */
+        [[nodiscard]] size_t probe(std::string_view name, size_t hash) const;
+
+        /**
+         * Method resizes the slot array and re-inserts all Dentries.
+         * @param slotCount new number of slots, power of two
+         */
+        void rehash(size_t slotCount);
+
+    public:
+        DirIndex() : mSlots(8), mCount(0) {}
+        ~DirIndex() = default;
+
+        /**
+         * Method fills the index with all DirEntries of a bucket.
+         * @param data bucket cluster
+         * @param count number of DirEntries in the bucket
+         * @param slotOffset offset of the first slot
+         */
+        void build(const char* data, uint count, uint slotOffset);
+
+        /**
+         * Method finds a Dentry by name.
+         * @param name to be searched for
+         * @return pointer to Dentry or nullptr, valid until the index is changed
+         */
+        [[nodiscard]] const Dentry* find(std::string_view name) const;
+
+        /**
+         * Method inserts a Dentry, replacing a Dentry of the same name.
+         * @param dentry to be inserted
+         */
+        void insert(const Dentry& dentry);
+
+        /**
+         * Method removes a Dentry by name (backward shift deletion, no tombstones).
+         * @param name of Dentry to be removed
+         */
+        void erase(std::string_view name);
+
+        [[nodiscard]] size_t size() const { return mCount; }
+};
+
+/**
+ * Class DentryCache - LRU cache of DirIndexes, keyed by bucket cluster. Its capacity counts DirEntries,
+ * so it takes the same memory whatever the cluster size is.
+ */
+class DentryCache {
+    public:
+        static constexpr size_t DEFAULT_CAPACITY = 64 * 1024;   // in DirEntries
+
+    private:
+        /**
+         * Structure Entry - one cached bucket.
+         */
+        struct Entry {
+            uint cluster;
+            DirIndex dirIndex;
+        };
+
+        std::list<Entry> mLru;      // most recently used at the front
+        std::unordered_map<uint, std::list<Entry>::iterator> mIndex;
+        size_t mEntries;            // DirEntries of all cached buckets
+        size_t mCapacity;
+
+        /**
+         * Method drops least recently used buckets until more DirEntries fit.
+         * @param incoming number of DirEntries to be added
+         */
+        void evict(size_t incoming);
+
+    public:
+        DentryCache() : mEntries(0), mCapacity(DEFAULT_CAPACITY) {}
+        ~DentryCache() = default;
+
+        /**
+         * Method returns the cached index of a bucket and marks it as recently used.
+         * @param cluster bucket cluster
+         * @return pointer to DirIndex or nullptr if not cached
+         */
+        const DirIndex* get(uint cluster);
+
+        /**
+         * Method caches an index of a bucket, evicting least recently used buckets until the DirEntries fit.
+         * @param cluster bucket cluster
+         * @param data of the bucket cluster
+         * @param count number of DirEntries in the bucket
+         * @param slotOffset offset of the first slot
+         * @return newly cached DirIndex
+         */
+        const DirIndex& put(uint cluster, const char* data, uint count, uint slotOffset);
+
+        /**
+         * Method inserts a Dentry into the index of a bucket, if the bucket is cached.
+         * @param cluster bucket cluster
+         * @param dentry to be inserted, replaces a Dentry of the same name
+         */
+        void insert(uint cluster, const Dentry& dentry);
+
+        /**
+         * Method removes a Dentry from the index of a bucket, if the bucket is cached.
+         * @param cluster bucket cluster
+         * @param name of Dentry to be removed
+         */
+        void erase(uint cluster, std::string_view name);
+
+        /**
+         * Method drops the index of a bucket, e.g. when the bucket is rewritten as a whole.
+         * @param cluster bucket cluster
+         */
+        void drop(uint cluster);
+
+        /**
+         * Method drops all cached buckets.
+         */
+        void clear();
+};
+
+/**
+ * Class BucketCache - LRU cache of bucket clusters of directories, keyed by start cluster of the directory.
+ */
+class BucketCache {
+    public:
+        static constexpr size_t DEFAULT_CAPACITY = 256;    // in directories
+
+    private:
+        /**
+         * Structure Entry - bucket clusters of one cached directory.
+         */
+        struct Entry {
+            uint cluster;
+            std::vector<uint> buckets;
+        };
+
+        std::list<Entry> mLru;      // most recently used at the front
+        std::unordered_map<uint, std::list<Entry>::iterator> mIndex;
+        size_t mCapacity;
+
+    public:
+        BucketCache() : mCapacity(DEFAULT_CAPACITY) {}
+        ~BucketCache() = default;
+
+        /**
+         * Method returns the cached bucket clusters of a directory and marks it as recently used.
+         * @param cluster start cluster of the directory
+         * @return pointer to bucket clusters or nullptr if not cached
+         */
+        std::vector<uint>* get(uint cluster);
+
+        /**
+         * Method caches bucket clusters of a directory, evicting the least recently used one if the cache is full.
+         * @param cluster start cluster of the directory
+         * @param buckets clusters of the directory, in order of their buckets
+         * @return newly cached bucket clusters
+         */
+        std::vector<uint>& put(uint cluster, std::vector<uint> buckets);
+
+        /**
+         * Method drops the bucket clusters of a directory.
+         * @param cluster start cluster of the directory
+         */
+        void drop(uint cluster);
+
+        /**
+         * Method drops all cached directories.
+         */
+        void clear();
+};
+
+/**
+ * Structure DefragReport - result of a defragmentation pass.
+ */
+struct DefragReport {
+    uint relocatedFiles;    // files moved into a single extent
+    uint relocatedDirs;     // directories with buckets after the first one moved into a single extent
+    size_t bytesMoved;      // bytes of clusters copied
+    uint fragmentedFiles;   // fragmented files left (over the limit or no free extent big enough)
+    uint fragmentedDirs;    // fragmented directories left
+};
+
+using FileHandle = uint;
+
+/**
+ * Enum class SeekOrigin - reference point of Filesystem::lseek().
+ */
+enum class SeekOrigin { SET, CUR, END };
+
+/**
+ * Structure OpenFile - state of a file opened by Filesystem::open().
+ */
+struct OpenFile {
+    uint parentCluster;     // directory of the file, to rewrite its DirEntry
+    DirEntry dirEntry;
+    size_t offset;          // current position in the file
+    uint cursorIndex;       // index of cursorCluster in the cluster chain
+    uint cursorCluster;     // last visited cluster, walks along the chain start here
+};
+
 /**
  * Class Filesystem - simplified FAT filesystem
+ *
+ * A directory is a linear hashing table - its cluster chain is the array of buckets and a DirEntry lives
+ * in the bucket given by the hash of its name. Each bucket starts with the number of its DirEntries,
+ * '.' and '..' are always the first two DirEntries of bucket 0. Position of a DirEntry in a directory
+ * is bucket * mMaxDirEntries + index in the bucket.
  */
 class Filesystem {
     private:
-        std::fstream mFileStream;
+        static constexpr uint IO_CHUNK_SIZE = 64_KB;      // max. bytes transferred by one disk access, at least a cluster
+        static constexpr uint BUCKET_HEADER_SIZE = sizeof(uint);  // number of DirEntries of a bucket
+
+        /**
+         * Method returns the offset of a DirEntry in a bucket.
+         * @param slot index of DirEntry in the bucket
+         * @return offset in bytes
+         */
+        static constexpr uint slot_offset(uint slot) { return BUCKET_HEADER_SIZE + slot * DirEntry::SIZE(); }
+
+        std::unique_ptr<Disk> mDisk;
+        WriteBackCache mWriteBack;  // keeps data clusters in memory, declared after mDisk to write them before it closes
+        Journal mJournal;       // all disk accesses go through it, declared after mWriteBack to commit before it stops
+        FatMirror mMirror;      // keeps FAT2 up to date in the background, if the disk has one
         std::string mDiskName;
+        DiskBackend mBackend;
         uint mTwoDirEntries;
-        std::array<char, CLUSTER_SIZE> mEmptyCluster;
+        uint mChunkClusters;    // max. clusters transferred by one disk access
 
         BootSector mBS;
         FAT mFAT;
         DirEntry mRootDir;
+        ClusterCache mCache;
+        BucketCache mBucketCache;
+        DentryCache mDentryCache;
+        std::unordered_map<FileHandle, OpenFile> mOpenFiles;
+        FileHandle mNextHandle;
+
+        /**
+         * Method returns the bucket clusters of a directory, loading them into the bucket cache if needed.
+         * @param dirCluster start cluster of the directory
+         * @return bucket clusters, valid until the next bucket cache change
+         */
+        std::vector<uint>& get_dir_buckets(uint dirCluster);
+
+        /**
+         * Method returns the name index of a bucket, loading it into the dentry cache if needed.
+         * @param bucketCluster cluster of the bucket
+         * @return DirIndex of the bucket, valid until the next dentry cache change
+         */
+        const DirIndex& get_bucket_index(uint bucketCluster);
+
+        /**
+         * Method returns the bucket of a name in a directory of bucketCount buckets.
+         * @param name of DirEntry
+         * @param bucketCount number of buckets of the directory
+         * @return index of bucket
+         */
+        static uint bucket_of(std::string_view name, uint bucketCount);
+
+        /**
+         * Method finds a bucket with a free slot for a new name, splitting buckets if needed.
+         * @param dirCluster start cluster of the directory
+         * @param name of the new DirEntry
+         * @return position of the free slot or std::nullopt if the directory cannot grow
+         */
+        std::optional<uint> reserve_dir_slot(uint dirCluster, std::string_view name);
+
+        /**
+         * Method appends a new bucket to a directory and moves the DirEntries which belong to it
+         * from the bucket being split.
+         * @param dirCluster start cluster of the directory
+         * @return true on success, false if there is no free cluster
+         */
+        bool split_dir_bucket(uint dirCluster);
+
+        /**
+         * Method merges the last buckets of a directory back into their split buckets, while the pairs are sparse.
+         * @param dirCluster start cluster of the directory
+         */
+        void merge_dir_buckets(uint dirCluster);
+
+        /**
+         * Method reads all buckets of a directory, one disk read per run of adjacent buckets.
+         * @param dirCluster start cluster of the directory
+         * @param consumer called for every bucket with its index and data, in order. Data are valid only during the call
+         */
+        void read_buckets(uint dirCluster, const BucketConsumer& consumer);
+
+        /**
+         * Method writes a changed count and one changed DirEntry of a bucket, the rest of it is untouched.
+         * @param cluster of the bucket
+         * @param count new number of DirEntries of the bucket
+         * @param slot index of the changed DirEntry in the bucket
+         * @param dirEntry to be written into slot
+         */
+        void write_bucket(uint cluster, uint count, uint slot, const DirEntry& dirEntry);
+
+        /**
+         * Method reads all DirEntries of a directory together with their positions.
+         * @param dirEntry directory to be read
+         * @return Dentries in order of their positions
+         */
+        std::vector<Dentry> read_dentries(const DirEntry& dirEntry);
+
+        /**
+         * Method finds room for a new DirEntry in a directory, the name must not exist there yet.
+         * @param parentCluster start cluster of the directory
+         * @param name of the new DirEntry
+         * @return position of the free slot or std::nullopt
+         */
+        std::optional<uint> find_room(uint parentCluster, const std::string& name);
+
+        /**
+         * Method writes a new DirEntry into a reserved slot of a directory.
+         * @param parentCluster start cluster of the directory
+         * @param position of the slot, see Filesystem::reserve_dir_slot()
+         * @param dirEntry to be written
+         */
+        void insert_dir_entry(uint parentCluster, uint position, const DirEntry& dirEntry);
+
+        /**
+         * Method allocates a DirEntry of a given size and links it into the parent directory.
+         * Checks for FAT fullness or name duplicate are done as well. File content is not written.
+         * @param parentCluster to know where to save the new DirEntry
+         * @param name of the new DirEntry
+         * @param isFile file type of new DirEntry
+         * @param size of new DirEntry content
+         * @return newly created DirEntry or std::nullopt
+         */
+        std::optional<DirEntry> allocate_dir_entry(uint parentCluster, const std::string& name, bool isFile, size_t size);
+
+        /**
+         * Method writes a new directory cluster containing only '.' and '..'. The cluster has to be wiped.
+         * @param cluster of the directory
+         * @param dot DirEntry pointing to the directory itself
+         * @param dotdot DirEntry pointing to the parent directory
+         */
+        void write_dir_cluster(uint cluster, const DirEntry& dot, const DirEntry& dotdot);
+
+        /**
+         * Method writes a DirEntry into its bucket of a directory.
+         * @param cluster start cluster of the directory
+         * @param position of DirEntry in the directory. Indexed from 0
+         * @param dirEntry to be written
+         */
+        void write_dir_entry(uint cluster, uint position, const DirEntry& dirEntry);
+
+        /**
+         * Method drops a DirEntry from its bucket, the last DirEntry of the bucket takes its slot.
+         * Clusters of the DirEntry are left untouched.
+         * @param parentCluster start cluster of the directory
+         * @param position of DirEntry in the directory. Indexed from 0
+         */
+        void unlink_dir_entry(uint parentCluster, uint position);
+
+        /**
+         * Method writes changed FAT pages as metadata, through the journal.
+         * They get to FAT2 once the journal commits them.
+         */
+        void flush_fat();
+
+        /**
+         * Method finishes a commit of the journal - committed FAT pages go to FAT2, freed clusters become free.
+         */
+        void journal_committed();
+
+        /**
+         * Method wipes clusters freed by committed groups and makes them free.
+         */
+        void release_freed_clusters();
+
+        /**
+         * Method makes sure there are enough free clusters, committing the pending group if its freed ones are needed.
+         * @param clusters number of clusters to be allocated
+         * @return true if enough clusters are free, else false
+         */
+        bool reserve_free(size_t clusters);
+
+        /**
+         * Method compares FAT with FAT2 of a mounted disk. A damaged FAT is replaced by a valid FAT2,
+         * otherwise FAT2 gets rewritten wherever it differs.
+         */
+        void verify_fat_mirror();
+
+        /**
+         * Method starts the background writer of FAT2, if the disk has one.
+         */
+        void start_fat_mirror();
+
+        /**
+         * Method overwrites clusters with zeros, run by run.
+         * @param clusters to be wiped
+         */
+        void wipe_clusters(const std::vector<uint>& clusters);
+
+        /**
+         * Method defragments a directory, its files and all its subdirectories.
+         * @param dirCluster cluster of the directory
+         * @param maxFiles maximum number of files and directories relocated in the whole pass
+         * @param report to be updated
+         */
+        void defrag_dir(uint dirCluster, uint maxFiles, DefragReport& report);
+
+        /**
+         * Method moves buckets of a directory after the first one into a single free extent and frees their
+         * old clusters. The first bucket stays, its cluster identifies the directory ('.', '..', parent).
+         * @param dirCluster start cluster of the directory
+         * @param buckets current bucket clusters of the directory
+         * @return true if moved, false if there is no free extent big enough
+         */
+        bool relocate_dir_buckets(uint dirCluster, const std::vector<uint>& buckets);
+
+        /**
+         * Method moves a file into a single free extent and frees its old clusters.
+         * @param parentCluster of the file
+         * @param position of the file in parent. Indexed from 0
+         * @param file to be moved, its start cluster gets updated
+         * @param clusters current cluster chain of the file
+         * @return true if moved, false if there is no free extent big enough
+         */
+        bool relocate_file(uint parentCluster, uint position, DirEntry& file, const std::vector<uint>& clusters);
+
+        /**
+         * Method rewrites a DirEntry in its parent directory, found by name.
+         * @param parentCluster of DirEntry
+         * @param dirEntry to be written
+         */
+        void update_dir_entry(uint parentCluster, const DirEntry& dirEntry);
+
+        /**
+         * Method returns an opened file.
+         * @param handle of the file
+         * @return pointer to opened file or nullptr if the handle is not valid
+         */
+        OpenFile* get_open_file(FileHandle handle);
+
+        /**
+         * Method checks if an opened file is the given file. Files are told apart by parent and name,
+         * files sharing clusters have the same start cluster.
+         * @param file opened file
+         * @param parentCluster directory of the file
+         * @param name of the file
+         * @return true if same, else false
+         */
+        static bool is_same_file(const OpenFile& file, uint parentCluster, std::string_view name);
+
+        /**
+         * Method checks if a file is opened.
+         * @param parentCluster directory of the file
+         * @param name of the file
+         * @return true if opened, else false
+         */
+        [[nodiscard]] bool is_open(uint parentCluster, std::string_view name) const;
+
+        /**
+         * Method copies the content of clusters into other clusters, run by run.
+         * @param from clusters to be copied
+         * @param to clusters to be written, same count as from
+         */
+        void copy_clusters(const std::vector<uint>& from, const std::vector<uint>& to);
+
+        /**
+         * Method cuts the shared clusters off a cluster chain.
+         * @param clusters chain of a file
+         * @return clusters used by this file only
+         */
+        [[nodiscard]] std::vector<uint> private_clusters(std::vector<uint> clusters) const;
+
+        /**
+         * Method gives a file its own copies of shared clusters up to a given index (copy-on-write).
+         * Clusters after the index stay shared. The start cluster of the file may change.
+         * @param file opened file, its cursor is reset
+         * @param lastIndex index of the last cluster that has to be private
+         * @return true on success, false if there are not enough free clusters
+         */
+        bool unshare_clusters(OpenFile& file, uint lastIndex);
+
+        /**
+         * Method counts the references of all clusters used by the files of a directory and its subdirectories.
+         * Every cluster reached for the second time gets another reference.
+         * @param dirCluster start cluster of the directory
+         * @param seen clusters reached so far
+         */
+        void count_references(uint dirCluster, std::vector<bool>& seen);
+
+        /**
+         * Method finds a cluster of an opened file. The chain is walked from the cursor of the file,
+         * or from the start if the cluster lies before the cursor.
+         * @param file opened file, its cursor is moved to the found cluster
+         * @param index of cluster in the cluster chain
+         * @return cluster
+         */
+        uint locate_cluster(OpenFile& file, uint index);
+
+        /**
+         * Method returns the number of adjacent clusters the chain continues with.
+         * @param cluster first cluster of the run
+         * @param maxClusters upper limit of the run length, at least one
+         * @return length of the run
+         */
+        uint run_length(uint cluster, uint maxClusters) const;
+
+        /**
+         * Method allocates clusters, so an opened file can hold end bytes. A full disk allocates less.
+         * @param file opened file
+         * @param end number of bytes the file should hold
+         * @return number of bytes the file can hold, at most end
+         */
+        size_t extend_file(OpenFile& file, size_t end);
+
+        /**
+         * Method writes the number of DirEntries of a bucket.
+         * @param cluster of the bucket
+         * @param count number of DirEntries
+         */
+        void write_bucket_entry_count(uint cluster, uint count);
+
+        /**
+         * Method returns the number of DirEntries of a bucket.
+         * @param cluster of the bucket
+         * @return number of DirEntries
+         */
+        uint get_bucket_entry_count(uint cluster);
 
     public:
-        explicit Filesystem(std::string name) : mDiskName(std::move(name)), mTwoDirEntries(2)  {
-            mEmptyCluster.fill('\0');
-        }
-        ~Filesystem() = default;
+        explicit Filesystem(std::string name, DiskBackend backend = DiskBackend::STREAM)
+            : mDiskName(std::move(name)), mBackend(backend), mTwoDirEntries(2), mChunkClusters(1), mNextHandle(0)  {}
+        ~Filesystem();
 
         /**
          * The de-facto constructor.
          * @param size
+         * @param clusterSize size of one cluster, see Utils::is_valid_cluster_size()
+         * @param fatMirror true to keep a second FAT (FAT2)
          */
-        void init(uint size);
+        void init(uint size, uint clusterSize = DEFAULT_CLUSTER_SIZE, bool fatMirror = false);
 
         /**
          * Loads FS from a file.
          */
         void mount();
 
+        /**
+         * Method returns the size of one cluster of the mounted filesystem.
+         * @return cluster size in bytes
+         */
+        [[nodiscard]] uint cluster_size() const { return mBS.mClusterSize; }
+
         /**
          * Method wipes all cluster, making the disk clean.
          */
@@ -209,6 +1027,14 @@ class Filesystem {
          */
         DirEntry get_dir_entry(uint cluster, bool isFile, bool last);
 
+        /**
+         * Method finds a child DirEntry of a directory by name. Only the bucket of the name is searched.
+         * @param name of the searched DirEntry, names are stored truncated to FILENAME_LEN
+         * @param parent directory to be searched
+         * @return Dentry (position and DirEntry) or std::nullopt
+         */
+        std::optional<Dentry> find_dir_entry(std::string_view name, const DirEntry& parent);
+
         /**
          * Method returns the position of a filename in a parent DirEntry.
          * @param searched file
@@ -235,7 +1061,19 @@ class Filesystem {
         std::optional<DirEntry> create_dir_entry(uint parentCluster, const std::string& name, bool isFile, const std::string& content = "");
 
         /**
-         * Method copies a DirEntry with a changed name.
+         * Method creates a file whose content is streamed from a source, chunk by chunk.
+         * Only one chunk of the source is held in memory at a time.
+         * @param parentCluster to know where to save the new DirEntry
+         * @param name of the new DirEntry
+         * @param source to read the content from
+         * @param size number of bytes to be read from source
+         * @return newly created DirEntry or std::nullopt
+         */
+        std::optional<DirEntry> create_dir_entry(uint parentCluster, const std::string& name, std::istream& source, size_t size);
+
+        /**
+         * Method copies a file with a changed name. The copy shares the cluster chain of the original,
+         * clusters are copied only once either file is modified.
          * @param parentCluster to know where to save the new DirEntry
          * @param toCopy DirEntry to be copied
          * @param nameOfCopy name of the new file
@@ -243,6 +1081,18 @@ class Filesystem {
          */
         std::optional<DirEntry> copy_dir_entry(uint parentCluster, const DirEntry& toCopy, const std::string& nameOfCopy);
 
+        /**
+         * Method creates a file with the content of two files one after another. If the first file ends
+         * on a cluster boundary, only its clusters are copied and the chain of the second one is shared.
+         * Otherwise both files are streamed into the new file chunk by chunk.
+         * @param parentCluster to know where to save the new DirEntry
+         * @param first file to be copied first
+         * @param second file to be appended to it
+         * @param name of the new file
+         * @return newly created DirEntry or std::nullopt
+         */
+        std::optional<DirEntry> concat_dir_entries(uint parentCluster, const DirEntry& first, const DirEntry& second, const std::string& name);
+
         /**
          * Method removes a DirEntry.
          * @param parentCluster of DirEntry to change his info
@@ -250,6 +1100,25 @@ class Filesystem {
          */
         void remove_dir_entry(uint parentCluster, uint position);
 
+        /**
+         * Method moves a DirEntry into another directory, optionally renaming it. Only DirEntries are
+         * rewritten, the content stays in its clusters. A moved directory gets its '..' changed.
+         * @param sourceCluster directory of the DirEntry
+         * @param name of the DirEntry
+         * @param targetCluster directory to be moved into
+         * @param newName name in the target directory
+         * @return true on success, else false
+         */
+        bool move_dir_entry(uint sourceCluster, std::string_view name, uint targetCluster, const std::string& newName);
+
+        /**
+         * Method checks if a directory lies inside another one, by walking its '..' up to the root.
+         * @param dirCluster start cluster of the directory
+         * @param ancestorCluster start cluster of the possible ancestor
+         * @return true if dirCluster is ancestorCluster or lies below it, else false
+         */
+        bool is_inside(uint dirCluster, uint ancestorCluster);
+
         /**
          * Method reads a DirEntry as a directory.
          * @param dirEntry to be read
@@ -264,6 +1133,134 @@ class Filesystem {
          */
         std::string read_dir_entry_as_file(const DirEntry& dirEntry);
 
+        /**
+         * Method reads a DirEntry as a file, handing its content to a consumer chunk by chunk.
+         * Adjacent clusters are read at once, so a chunk spans one run of adjacent clusters at most.
+         * @param dirEntry to be read
+         * @param consumer called for every chunk of content, in order. A chunk is valid only during the call
+         */
+        void read_dir_entry_as_file(const DirEntry& dirEntry, const ChunkConsumer& consumer);
+
+        /**
+         * Method opens a file for reading and writing, positioned at its start.
+         * @param parentCluster directory of the file
+         * @param name of the file
+         * @return handle of the opened file or std::nullopt
+         */
+        std::optional<FileHandle> open(uint parentCluster, std::string_view name);
+
+        /**
+         * Method reads bytes from the current position of an opened file. Only the clusters of the
+         * read range are accessed, whole clusters are read straight into data.
+         * @param handle of the file
+         * @param data buffer of at least size bytes
+         * @param size number of bytes to be read
+         * @return number of bytes read, less than size at the end of file
+         */
+        size_t read(FileHandle handle, char* data, size_t size);
+
+        /**
+         * Method writes bytes at the current position of an opened file, the file grows if needed.
+         * Only the clusters of the written range are accessed.
+         * @param handle of the file
+         * @param data to be written
+         * @param size number of bytes to be written
+         * @return number of bytes written, less than size if the disk is full
+         */
+        size_t write(FileHandle handle, const char* data, size_t size);
+
+        /**
+         * Method moves the current position of an opened file.
+         * @param handle of the file
+         * @param offset relative to origin
+         * @param origin start, current position or end of file
+         * @return new position or std::nullopt if it lies outside of the file
+         */
+        std::optional<size_t> lseek(FileHandle handle, long offset, SeekOrigin origin);
+
+        /**
+         * Method closes an opened file.
+         * @param handle of the file
+         * @return true on success, false if the handle is not valid
+         */
+        bool close(FileHandle handle);
+
+        /**
+         * Method appends content to the end of a file in place. The slack of the last cluster is filled first,
+         * then new clusters are linked onto the chain and only the size in the parent DirEntry is rewritten.
+         * Nothing is changed if the disk cannot hold the whole content.
+         * @param parentCluster directory of the file
+         * @param name of the file
+         * @param content to be appended
+         * @return new size of the file or std::nullopt
+         */
+        std::optional<size_t> append(uint parentCluster, std::string_view name, std::string_view content);
+
+        /**
+         * Method changes the size of a file in place. Shrinking frees only the clusters past the new end,
+         * growing links wiped clusters onto the chain. Only the size in the parent DirEntry is rewritten.
+         * @param parentCluster directory of the file
+         * @param name of the file
+         * @param size new size of the file
+         * @return true on success, else false
+         */
+        bool truncate(uint parentCluster, std::string_view name, size_t size);
+
+        /**
+         * Method commits all pending metadata changes and makes the disk image persistent, FAT2 included.
+         */
+        void sync() {
+            mJournal.flush();
+            mMirror.wait();
+        }
+
+        /**
+         * Method changes how clusters of new files are allocated.
+         * @param mode allocation mode
+         */
+        void set_allocation_mode(FAT::AllocationMode mode) { mFAT.set_allocation_mode(mode); }
+
+        /**
+         * Method changes the capacity of the cluster cache.
+         * @param capacity new capacity in bytes
+         */
+        void set_cache_capacity(size_t capacity) { mCache.set_capacity(capacity); }
+
+        /**
+         * Method returns the cluster cache, e.g. to read its statistics.
+         * @return cluster cache
+         */
+        [[nodiscard]] const ClusterCache& cache() const { return mCache; }
+
+        /**
+         * Method sets when dirty data clusters are written to the disk.
+         * @param policy see FlushPolicy
+         * @param interval period of FlushPolicy::INTERVAL
+         */
+        void set_flush_policy(FlushPolicy policy, std::chrono::milliseconds interval = std::chrono::milliseconds{0}) {
+            mWriteBack.set_policy(policy, interval);
+        }
+
+        /**
+         * Method returns the write-back cache, e.g. to read its policy.
+         * @return write-back cache
+         */
+        [[nodiscard]] WriteBackCache& write_back() { return mWriteBack; }
+
+        /**
+         * Method finishes a shell command, see FlushPolicy::COMMAND.
+         */
+        void end_command() { mWriteBack.end_command(); }
+
+        /**
+         * Method relocates fragmented files and directory buckets into contiguous extents. Every file and directory
+         * is relocated on its own and the pass can be limited, so defragmentation may be done incrementally by
+         * repeated calls.
+         * @param maxFiles maximum number of files and directories to be relocated
+         * @return report of the pass
+         */
+        DefragReport defrag(uint maxFiles = UINT_MAX);
+
         /**
          * Method return all cluster locations of a DirEntry.
          * @param dirEntry whose locations we want to know
@@ -0,0 +1,184 @@
+#include "Journal.hpp"
+
+#include <cstring>
+#include <utility>
+
+Journal::~Journal() {
+    if (mDisk != nullptr) Journal::commit();
+}
+
+uint Journal::size_for(uint diskSize) {
+    if (diskSize < MIN_DISK_SIZE) return 0;
+    return std::min(diskSize / 32 / BLOCK_SIZE * BLOCK_SIZE, MAX_SIZE);
+}
+
+void Journal::attach(Disk& disk, size_t start, size_t size) {
+    mDisk = &disk;
+    mStart = start;
+    mDepth = 0;
+    mLogging = 0;
+    mOperations = 0;
+    mBlocks.clear();
+
+    // header block, index table and the blocks themselves have to fit in
+    size_t blocks = size / BLOCK_SIZE;
+    size_t indicesPerBlock = BLOCK_SIZE / sizeof(uint);
+    mCapacity = (blocks > 2) ? (blocks - 1) * indicesPerBlock / (indicesPerBlock + 1) : 0;
+}
+
+void Journal::format() {
+    if (!Journal::enabled()) return;
+    Header header{MAGIC, 0, 0};
+    mDisk->write_at(mStart, reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+uint Journal::checksum(const std::vector<char>& index, const std::vector<char>& blocks) {
+    uint hash = 2166136261u;
+    for (const auto* part : {&index, &blocks}) {
+        for (char c : *part) {
+            hash ^= static_cast<uchar>(c);
+            hash *= 16777619u;
+        }
+    }
+    return hash;
+}
+
+void Journal::end_operation() {
+    if (--mDepth > 0) return;
+    bool old = !mBlocks.empty() && std::chrono::steady_clock::now() - mGroupStart >= COMMIT_INTERVAL;
+    if (++mOperations >= GROUP_OPERATIONS || old) Journal::commit();
+}
+
+void Journal::commit() {
+    mOperations = 0;
+    if (!mBlocks.empty()) Journal::write_group();
+    if (!mOnCommit) return;
+
+    // the callback may be called in the middle of a metadata scope, when the group got full
+    uint logging = std::exchange(mLogging, 0);
+    mOnCommit();
+    mLogging = logging;
+}
+
+void Journal::write_group() {
+    // blocks are kept in order of their indices, so adjacent ones are adjacent in the group too
+    size_t count = mBlocks.size();
+    std::vector<char> index(Journal::index_size(count), '\0'), blocks(count * BLOCK_SIZE);
+    size_t i = 0;
+    for (const auto& [block, data] : mBlocks) {
+        uint idx = block;
+        std::memcpy(index.data() + i * sizeof(uint), &idx, sizeof(idx));
+        std::memcpy(blocks.data() + i * BLOCK_SIZE, data.data(), BLOCK_SIZE);
+        i++;
+    }
+
+    // write-ahead: the group is durable before any block reaches its place
+    mDisk->write_at(mStart + BLOCK_SIZE, index.data(), index.size());
+    mDisk->write_at(mStart + BLOCK_SIZE + index.size(), blocks.data(), blocks.size());
+    mDisk->flush();
+    Header header{MAGIC, static_cast<uint>(count), Journal::checksum(index, blocks)};
+    mDisk->write_at(mStart, reinterpret_cast<const char *>(&header), sizeof(header));
+    mDisk->flush();
+
+    // checkpoint - runs of adjacent blocks are written at once
+    auto it = mBlocks.begin();
+    i = 0;
+    while (it != mBlocks.end()) {
+        size_t first = it->first, length = 0;
+        while (it != mBlocks.end() && it->first == first + length) {
+            ++it;
+            ++length;
+        }
+        mDisk->write_at(first * BLOCK_SIZE, blocks.data() + i * BLOCK_SIZE, length * BLOCK_SIZE);
+        i += length;
+    }
+    mDisk->flush();
+    mBlocks.clear();
+
+    // the cleared header has to be durable before clusters freed by the group get reused,
+    // a replay would write the group's blocks (e.g. directory buckets) over their new content
+    Journal::format();
+    mDisk->flush();
+}
+
+bool Journal::replay() {
+    if (!Journal::enabled()) return false;
+
+    Header header{};
+    mDisk->read_at(mStart, reinterpret_cast<char *>(&header), sizeof(header));
+    if (header.magic != MAGIC || header.count == 0 || header.count > mCapacity) return false;
+
+    std::vector<char> index(Journal::index_size(header.count)), blocks(static_cast<size_t>(header.count) * BLOCK_SIZE);
+    mDisk->read_at(mStart + BLOCK_SIZE, index.data(), index.size());
+    mDisk->read_at(mStart + BLOCK_SIZE + index.size(), blocks.data(), blocks.size());
+    if (Journal::checksum(index, blocks) != header.checksum) return false;     // torn group, never committed
+
+    for (size_t i = 0; i < header.count; ++i) {
+        uint block;
+        std::memcpy(&block, index.data() + i * sizeof(uint), sizeof(block));
+        mDisk->write_at(static_cast<size_t>(block) * BLOCK_SIZE, blocks.data() + i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    mDisk->flush();
+    Journal::format();
+    mDisk->flush();     // clusters freed by the group are free from now on, see write_group()
+    return true;
+}
+
+void Journal::patch(size_t offset, const char* data, size_t size) {
+    size_t end = offset + size;
+    for (auto it = mBlocks.lower_bound(offset / BLOCK_SIZE); it != mBlocks.end() && it->first * BLOCK_SIZE < end; ++it) {
+        size_t blockStart = it->first * BLOCK_SIZE;
+        size_t from = std::max(offset, blockStart), to = std::min(end, blockStart + BLOCK_SIZE);
+        std::memcpy(it->second.data() + (from - blockStart), data + (from - offset), to - from);
+    }
+}
+
+void Journal::read_at(size_t offset, char* data, size_t size) {
+    mDisk->read_at(offset, data, size);
+
+    // pending blocks are newer than the disk image
+    size_t end = offset + size;
+    for (auto it = mBlocks.lower_bound(offset / BLOCK_SIZE); it != mBlocks.end() && it->first * BLOCK_SIZE < end; ++it) {
+        size_t blockStart = it->first * BLOCK_SIZE;
+        size_t from = std::max(offset, blockStart), to = std::min(end, blockStart + BLOCK_SIZE);
+        std::memcpy(data + (from - offset), it->second.data() + (from - blockStart), to - from);
+    }
+}
+
+void Journal::write_at(size_t offset, const char* data, size_t size) {
+    if (size == 0) return;
+    if (mLogging == 0 || !Journal::enabled()) {
+        mDisk->write_at(offset, data, size);
+        Journal::patch(offset, data, size);
+        return;
+    }
+
+    size_t first = offset / BLOCK_SIZE, last = (offset + size - 1) / BLOCK_SIZE;
+    size_t newBlocks = 0;
+    for (size_t block = first; block <= last; ++block) {
+        if (!mBlocks.contains(block)) newBlocks++;
+    }
+    if (mBlocks.size() + newBlocks > mCapacity) {
+        // the group is full - committed in the middle of an operation, the order of writes is kept
+        Journal::commit();
+        if (last - first + 1 > mCapacity) {     // does not fit into the journal at all
+            mDisk->write_at(offset, data, size);
+            return;
+        }
+    }
+
+    // partially written blocks start as their current content
+    if (mBlocks.empty()) mGroupStart = std::chrono::steady_clock::now();
+    for (size_t block = first; block <= last; ++block) {
+        auto [it, inserted] = mBlocks.try_emplace(block);
+        if (!inserted) continue;
+        it->second.resize(BLOCK_SIZE);
+        mDisk->read_at(block * BLOCK_SIZE, it->second.data(), BLOCK_SIZE);
+    }
+    Journal::patch(offset, data, size);
+}
+
+void Journal::flush() {
+    Journal::commit();
+    mDisk->flush();
+}
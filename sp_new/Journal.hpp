@@ -0,0 +1,170 @@
+#pragma once
+
+#include <map>
+#include <chrono>
+#include <vector>
+#include <functional>
+#include "Disk.hpp"
+#include "Utils.hpp"
+
+/**
+ * Class Journal - write-ahead journal of metadata, a Disk layered over the disk image.
+ *
+ * Writes made inside of a metadata scope do not go to their place. Their blocks are kept in memory
+ * and committed in groups - written into the journal region first, then to their place. A group is
+ * committed after GROUP_OPERATIONS operations, by the first operation finished COMMIT_INTERVAL after
+ * the group started, when the journal gets full, or on sync(). An idle journal does not commit by
+ * itself, so the last operations are durable only after the next one or sync(). Reads see the kept
+ * blocks, other writes go straight to the disk image (and update kept blocks).
+ *
+ * Journal region: header block (magic, block count, checksum), table of block indices, blocks.
+ * A group counts only once its header is written, so mount either replays all of it or nothing.
+ */
+class Journal : public Disk {
+    public:
+        static constexpr uint BLOCK_SIZE = 512_B;
+        static constexpr uint MAGIC = 0x4c4e524a;           // "JRNL"
+        static constexpr uint GROUP_OPERATIONS = 16;        // operations committed at once
+        static constexpr std::chrono::milliseconds COMMIT_INTERVAL{1000};  // max. age of a group to be committed
+        static constexpr uint MIN_DISK_SIZE = 256_KB;       // smaller disks have no journal
+        static constexpr uint MAX_SIZE = 1_MB;
+
+        /**
+         * Class Scope - RAII guard of an operation or a metadata scope, nested guards are allowed.
+         */
+        class Scope {
+            private:
+                Journal* mJournal;
+                bool mMetadata;
+
+            public:
+                Scope(Journal& journal, bool metadata) : mJournal(&journal), mMetadata(metadata) {
+                    if (mMetadata) mJournal->mLogging++;
+                    else mJournal->mDepth++;
+                }
+                ~Scope() {
+                    if (mMetadata) mJournal->mLogging--;
+                    else mJournal->end_operation();
+                }
+                Scope(const Scope&) = delete;
+                Scope& operator=(const Scope&) = delete;
+        };
+
+    private:
+        /**
+         * Structure Header - first block of the journal region.
+         */
+        struct Header {
+            uint magic;
+            uint count;         // number of blocks of the committed group, 0 -> nothing to replay
+            uint checksum;      // of the index table and the blocks
+        };
+
+        Disk* mDisk = nullptr;
+        size_t mStart = 0;          // start address of the journal region
+        uint mCapacity = 0;         // max. blocks of a group, 0 -> journal disabled
+        uint mDepth = 0;            // nested operations in progress
+        uint mLogging = 0;          // nested metadata scopes
+        uint mOperations = 0;       // finished operations of the pending group
+        std::chrono::steady_clock::time_point mGroupStart;  // when the first block of the pending group was kept
+        std::map<size_t, std::vector<char>> mBlocks;    // block index -> pending block
+        std::function<void ()> mOnCommit;               // called once everything journaled is in place
+
+        /**
+         * Method finishes an operation, the pending group is committed after enough of them or once it is old enough.
+         */
+        void end_operation();
+
+        /**
+         * Method writes the pending group - journal region first, then the blocks to their place.
+         */
+        void write_group();
+
+        /**
+         * Method copies written data into the kept blocks it overlaps.
+         * @param offset position in disk image
+         * @param data written
+         * @param size number of bytes written
+         */
+        void patch(size_t offset, const char* data, size_t size);
+
+        /**
+         * Method returns the size of the index table of a group, whole blocks.
+         * @param count number of blocks of the group
+         * @return size in bytes
+         */
+        static size_t index_size(size_t count) {
+            return (count * sizeof(uint) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+        }
+
+        /**
+         * Method computes the checksum of a group (32-bit FNV-1a).
+         * @param index table of block indices
+         * @param blocks data of the blocks
+         * @return checksum
+         */
+        static uint checksum(const std::vector<char>& index, const std::vector<char>& blocks);
+
+    public:
+        Journal() = default;
+        ~Journal() override;
+
+        /**
+         * Method returns the size of the journal region for a disk.
+         * @param diskSize total size of FS
+         * @return size in bytes, whole blocks, 0 for small disks
+         */
+        static uint size_for(uint diskSize);
+
+        /**
+         * The de-facto constructor. Drops all pending blocks.
+         * @param disk disk image, all accesses go to it
+         * @param start start address of the journal region
+         * @param size size of the journal region, 0 disables the journal
+         */
+        void attach(Disk& disk, size_t start, size_t size);
+
+        /**
+         * Method clears the journal region of a new disk.
+         */
+        void format();
+
+        /**
+         * Method writes the committed group left in the journal region to its place, e.g. after a crash.
+         * @return true if a group was replayed, else false
+         */
+        bool replay();
+
+        /**
+         * Method commits the pending group - journal region first, then the blocks to their place.
+         * The commit callback is called afterwards, even if there was nothing to commit.
+         */
+        void commit();
+
+        /**
+         * Method sets a callback called after every commit, e.g. to reuse what the committed group freed.
+         * Its writes are not journaled.
+         * @param callback to be called, nullptr for none
+         */
+        void on_commit(std::function<void ()> callback) { mOnCommit = std::move(callback); }
+
+        /**
+         * Method starts an operation. The pending group is committed only between operations.
+         * @return guard ending the operation
+         */
+        [[nodiscard]] Scope operation() { return Scope{*this, false}; }
+
+        /**
+         * Method starts a metadata scope, its writes are journaled.
+         * @return guard ending the scope
+         */
+        [[nodiscard]] Scope metadata() { return Scope{*this, true}; }
+
+        [[nodiscard]] bool enabled() const { return mCapacity > 0; }
+
+        bool create(const std::string& name, size_t size) override { return mDisk->create(name, size); }
+        bool open(const std::string& name) override { return mDisk->open(name); }
+        void read_at(size_t offset, char* data, size_t size) override;
+        void write_at(size_t offset, const char* data, size_t size) override;
+        void flush() override;
+};
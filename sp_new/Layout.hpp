@@ -0,0 +1,124 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <span>
+#include <string>
+#include <type_traits>
+
+// records are encoded by plain copies of their fields, which is only valid on a little-endian host
+static_assert(std::endian::native == std::endian::little, "On-disk records are little-endian");
+
+/**
+ * Structure Scalar - a trivially copyable field of an on-disk record, stored byte by byte as in memory.
+ * @tparam Member pointer to the field
+ */
+template<auto Member>
+struct Scalar;
+
+template<typename Record, typename T, T Record::* Member>
+struct Scalar<Member> {
+    static_assert(std::is_trivially_copyable_v<T>, "Scalar field must be trivially copyable");
+    static constexpr size_t SIZE = sizeof(T);
+
+    static void encode(const Record& record, char* data) {
+        std::memcpy(data, &(record.*Member), SIZE);
+    }
+
+    static void decode(Record& record, const char* data) {
+        std::memcpy(&(record.*Member), data, SIZE);
+    }
+};
+
+/**
+ * Structure FixedString - a std::string field of an on-disk record, stored zero padded to a fixed length.
+ * @tparam Member pointer to the field
+ * @tparam Length number of bytes on disk
+ */
+template<auto Member, size_t Length>
+struct FixedString;
+
+template<typename Record, std::string Record::* Member, size_t Length>
+struct FixedString<Member, Length> {
+    static constexpr size_t SIZE = Length;
+
+    static void encode(const Record& record, char* data) {
+        const std::string& str = record.*Member;
+        size_t size = std::min(str.size(), Length);
+        std::memcpy(data, str.data(), size);
+        std::memset(data + size, '\0', Length - size);
+    }
+
+    static void decode(Record& record, const char* data) {
+        record.*Member = std::string{data, Length};
+    }
+};
+
+/**
+ * Structure RecordLayout - compile-time description of an on-disk record. Fields are packed
+ * in the given order with no padding, encode() and decode() are generated from them.
+ * @tparam Fields Scalar or FixedString fields of the record
+ */
+template<typename ... Fields>
+struct RecordLayout {
+    static constexpr size_t FIELD_COUNT = sizeof...(Fields);
+    static constexpr size_t SIZE = (0 + ... + Fields::SIZE);
+
+    // offset of every field, in order of fields
+    static constexpr std::array<size_t, FIELD_COUNT> OFFSETS = [] {
+        std::array<size_t, FIELD_COUNT> offsets{};
+        size_t offset = 0, idx = 0;
+        ((offsets[idx++] = offset, offset += Fields::SIZE), ...);
+        return offsets;
+    }();
+
+    /**
+     * Method encodes a record into a buffer.
+     * @param record to be encoded
+     * @param data buffer of at least SIZE bytes
+     */
+    template<typename Record>
+    static void encode(const Record& record, char* data) {
+        size_t idx = 0;
+        (Fields::encode(record, data + OFFSETS[idx++]), ...);
+    }
+
+    /**
+     * Method decodes a record from a buffer.
+     * @param record to be decoded into
+     * @param data buffer of at least SIZE bytes
+     */
+    template<typename Record>
+    static void decode(Record& record, const char* data) {
+        size_t idx = 0;
+        (Fields::decode(record, data + OFFSETS[idx++]), ...);
+    }
+
+    /**
+     * Method encodes an array of records into a buffer, records follow each other with no gaps.
+     * @param records to be encoded
+     * @param data buffer of at least records.size() * SIZE bytes
+     */
+    template<typename Record>
+    static void encode_all(std::span<const Record> records, char* data) {
+        for (const auto& record : records) {
+            RecordLayout::encode(record, data);
+            data += SIZE;
+        }
+    }
+
+    /**
+     * Method decodes an array of records from a buffer, records follow each other with no gaps.
+     * @param records to be decoded into
+     * @param data buffer of at least records.size() * SIZE bytes
+     */
+    template<typename Record>
+    static void decode_all(std::span<Record> records, const char* data) {
+        for (auto& record : records) {
+            RecordLayout::decode(record, data);
+            data += SIZE;
+        }
+    }
+};
\ No newline at end of file
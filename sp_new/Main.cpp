@@ -8,12 +8,18 @@
  * @return 0 on success, else false
  */
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        std::cout << "No. of req. arguments:  2" << std::endl;
+    if (argc != 2 && argc != 3) {
+        std::cout << "No. of req. arguments:  2 (optionally 3 - disk backend)" << std::endl;
         std::cout << "No. of found arguments: " << argc << std::endl;
         return EXIT_FAILURE;
     }
-    Shell sh(argv[1]);
+
+    auto backend = (argc == 3) ? Disk::parse_backend(argv[2]) : DiskBackend::STREAM;
+    if (!backend) {
+        std::cout << "Invalid disk backend: " << argv[2] << " - use 'stream' or 'mmap'" << std::endl;
+        return EXIT_FAILURE;
+    }
+    Shell sh(argv[1], backend.value());
     sh.run(std::cin);
 
     return EXIT_SUCCESS;
@@ -0,0 +1,97 @@
+#include "Mirror.hpp"
+
+FatMirror::~FatMirror() {
+    FatMirror::stop();
+}
+
+bool FatMirror::start(std::unique_ptr<Disk> disk, const std::string& name, size_t startAddress, uint pageEntries) {
+    FatMirror::stop();
+    if (!disk->open(name)) return false;
+
+    mDisk = std::move(disk);
+    mStartAddress = startAddress;
+    mPageEntries = pageEntries;
+    mStaged.clear();
+    mStop = false;
+    mWorker = std::thread(&FatMirror::run, this);
+    return true;
+}
+
+void FatMirror::stop() {
+    if (!mWorker.joinable()) return;
+    {
+        std::lock_guard lock(mMutex);
+        mStop = true;
+    }
+    mWake.notify_one();
+    mWorker.join();
+    mDisk.reset();
+}
+
+void FatMirror::add_pages(std::map<uint, std::vector<int>>& pages, uint firstEntry, std::span<const int> entries) const {
+    for (size_t offset = 0; offset < entries.size(); offset += mPageEntries) {
+        auto page = entries.subspan(offset, std::min<size_t>(mPageEntries, entries.size() - offset));
+        pages[firstEntry + offset].assign(page.begin(), page.end());
+    }
+}
+
+void FatMirror::enqueue(uint firstEntry, std::span<const int> entries) {
+    {
+        std::lock_guard lock(mMutex);
+        FatMirror::add_pages(mPending, firstEntry, entries);
+    }
+    mWake.notify_one();
+}
+
+void FatMirror::stage(uint firstEntry, std::span<const int> entries) {
+    FatMirror::add_pages(mStaged, firstEntry, entries);
+}
+
+void FatMirror::publish() {
+    if (mStaged.empty()) return;
+    {
+        std::lock_guard lock(mMutex);
+        for (auto& [firstEntry, page] : mStaged) mPending[firstEntry] = std::move(page);
+    }
+    mStaged.clear();
+    mWake.notify_one();
+}
+
+void FatMirror::wait() {
+    std::unique_lock lock(mMutex);
+    mIdle.wait(lock, [this] { return (mPending.empty() && !mBusy) || !mWorker.joinable(); });
+}
+
+void FatMirror::run() {
+    std::unique_lock lock(mMutex);
+    while (true) {
+        mWake.wait(lock, [this] { return !mPending.empty() || mStop; });
+        if (mPending.empty()) break;   // stopped, nothing left to write
+
+        // take all queued pages and write them without holding the lock
+        auto pages = std::move(mPending);
+        mPending.clear();
+        mBusy = true;
+        lock.unlock();
+
+        auto it = pages.begin();
+        std::vector<int> run{};
+        while (it != pages.end()) {
+            // adjacent pages are written at once
+            uint firstEntry = it->first;
+            run.clear();
+            while (it != pages.end() && it->first == firstEntry + run.size()) {
+                run.insert(run.end(), it->second.begin(), it->second.end());
+                ++it;
+            }
+            mDisk->write_at(mStartAddress + static_cast<size_t>(firstEntry) * sizeof(int),
+                            reinterpret_cast<const char *>(run.data()), run.size() * sizeof(int));
+        }
+        mDisk->flush();
+
+        lock.lock();
+        mBusy = false;
+        if (mPending.empty()) mIdle.notify_all();
+    }
+    mIdle.notify_all();
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <map>
+#include <span>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "Disk.hpp"
+#include "Utils.hpp"
+
+/**
+ * Class FatMirror - keeps the second FAT (FAT2) a copy of the first one. Changed FAT runs are staged
+ * by the foreground and queued once FAT1 holds them for good (the journal group with them is committed),
+ * then written by a background thread, through its own handle of the disk image. So FAT2 never shows
+ * uncommitted changes, it lags behind FAT1 a bit. FAT1 is the one to be trusted while it is valid.
+ */
+class FatMirror {
+    private:
+        std::unique_ptr<Disk> mDisk;
+        size_t mStartAddress = 0;                   // start address of FAT2
+        uint mPageEntries = 1;                      // FAT entries per page
+        std::map<uint, std::vector<int>> mStaged;   // first entry of a page -> its staged entries, foreground only
+        std::map<uint, std::vector<int>> mPending;  // first entry of a page -> its queued entries
+        bool mBusy = false;                         // the worker is writing runs taken from mPending
+        bool mStop = false;
+        std::mutex mMutex;
+        std::condition_variable mWake;              // new runs or stop
+        std::condition_variable mIdle;              // everything queued is written
+        std::thread mWorker;
+
+        /**
+         * Method of the background thread - writes queued runs until stopped.
+         */
+        void run();
+
+        /**
+         * Method splits a run of FAT entries into pages, pages already in the map are replaced.
+         * @param pages map of pages
+         * @param firstEntry index of the first entry of the run, at a FAT page boundary
+         * @param entries of the run
+         */
+        void add_pages(std::map<uint, std::vector<int>>& pages, uint firstEntry, std::span<const int> entries) const;
+
+    public:
+        FatMirror() = default;
+        ~FatMirror();
+
+        /**
+         * Method opens its own handle of the disk image and starts the background thread.
+         * @param disk new disk of the same backend as the filesystem
+         * @param name of the disk image
+         * @param startAddress start address of FAT2
+         * @param pageEntries FAT entries per page, queued runs are kept page by page
+         * @return true on success, else false
+         */
+        bool start(std::unique_ptr<Disk> disk, const std::string& name, size_t startAddress, uint pageEntries);
+
+        /**
+         * Method stops the background thread, everything queued is written first.
+         */
+        void stop();
+
+        /**
+         * Method queues a run of changed FAT entries. Queued pages of the run are replaced.
+         * @param firstEntry index of the first entry of the run, at a FAT page boundary
+         * @param entries of the run
+         */
+        void enqueue(uint firstEntry, std::span<const int> entries);
+
+        /**
+         * Method stages a run of changed FAT entries, it is queued by FatMirror::publish().
+         * @param firstEntry index of the first entry of the run, at a FAT page boundary
+         * @param entries of the run
+         */
+        void stage(uint firstEntry, std::span<const int> entries);
+
+        /**
+         * Method queues all staged runs, e.g. once the journal committed them to FAT1.
+         */
+        void publish();
+
+        /**
+         * Method waits until everything queued is written and flushed.
+         */
+        void wait();
+
+        [[nodiscard]] bool running() const { return mWorker.joinable(); }
+};
@@ -8,8 +8,9 @@ using namespace std::string_literals;
 
 static const std::regex REGEX_FORMAT("[1-9]+[0-9]*(kb|Kb|KB|mb|Mb|MB)");
 static const std::regex REGEX_KB("(kb|Kb|KB){1}");
+static const std::regex REGEX_NUMBER("[0-9]+");
 
-Shell::Shell(const std::string& fsName) : mFsName(fsName), mCWD("/"), mCWC(0) {
+Shell::Shell(const std::string& fsName, DiskBackend backend) : mFsName(fsName), mBackend(backend), mCWD("/"), mCWC(0) {
     fill_args_count();
     fill_handlers();
 
@@ -23,6 +24,9 @@ Shell::Shell(const std::string& fsName) : mFsName(fsName), mCWD("/"), mCWC(0) {
         std::cout << "Create new disk by using cmd: 'format [x][y]'" << std::endl;
         std::cout << "[x] = positive integer" << std::endl;
         std::cout << "[y] = KB or MB (case sensitive)" << std::endl;
+        std::cout << "Optionally append cluster size: power of two from 512 to 1MB (default 512)" << std::endl;
+        std::cout << "Optionally append disk backend: 'stream' (default) or 'mmap'" << std::endl;
+        std::cout << "Optionally append 'fat2' to keep a second FAT" << std::endl;
     }
 }
 
@@ -52,11 +56,13 @@ void Shell::fill_handlers() {
         std::filesystem::path fromPath(args.front());
         std::filesystem::path toPath(args.back());
 
-        // check if source file exists
-        std::optional<DirEntry> fileToMove = Shell::get_dir_entry_from_path(fromPath.string(), DirEntryType::BOTH);
-        if (!fileToMove) return true;
-        if (!fileToMove->mIsFile) {
-            std::cout << Utils::remove_padding(fileToMove->mFilename) << " is a directory" << std::endl;
+        // check if source exists
+        std::optional<DirEntry> toMove = Shell::get_dir_entry_from_path(fromPath.string(), DirEntryType::BOTH);
+        if (!toMove) return true;
+
+        // current dir would lose its path
+        if (!toMove->mIsFile && mFilesystem->is_inside(mCWC, toMove->mStartCluster)) {
+            std::cout << "Cannot move " << Utils::remove_padding(toMove->mFilename) << " - current directory is inside" << std::endl;
             return true;
         }
 
@@ -64,18 +70,13 @@ void Shell::fill_handlers() {
         std::optional<DirEntry> targetDir = Shell::get_dir_entry_from_path(toPath.parent_path().string(), DirEntryType::DIR);
         if (!targetDir) return true;
 
-        // getting parent cluster of to-be-moved file
+        // getting parent cluster of to-be-moved DirEntry
         std::optional<DirEntry> sourceDir = Shell::get_dir_entry_from_path(fromPath.parent_path().string(), DirEntryType::DIR);
 
-        // copy source file
-        auto opt = mFilesystem->copy_dir_entry(targetDir->mStartCluster, fileToMove.value(), toPath.filename().string());
-
-        // check if it is a duplicate - end prematurely to not delete source file
-        if (!opt) return true;
-
-        // remove source file
-        auto position = mFilesystem->get_position(Utils::remove_padding(fileToMove->mFilename), sourceDir.value());
-        mFilesystem->remove_dir_entry(sourceDir->mStartCluster, position);
+        // relink the DirEntry - content stays where it is
+        auto moved = mFilesystem->move_dir_entry(sourceDir->mStartCluster, Utils::remove_padding(toMove->mFilename),
+                                                 targetDir->mStartCluster, toPath.filename().string());
+        if (moved) Shell::invalidate_path(fromPath.string());
 
         return true;
     };
@@ -94,8 +95,10 @@ void Shell::fill_handlers() {
         if (!dir) return true;
 
         auto position = mFilesystem->get_position(path.filename().string(), dir.value());
-        if (position >= 0)
+        if (position >= 0) {
             mFilesystem->remove_dir_entry(dir->mStartCluster, position);
+            Shell::invalidate_path(path.string());
+        }
         else
             std::cout << path.filename().string() << " - no such file" << std::endl;
 
@@ -131,8 +134,10 @@ void Shell::fill_handlers() {
         if (!dir) return true;
 
         auto position = mFilesystem->get_position(path.filename().string(), dir.value());
-        if (position >= 0)
+        if (position >= 0) {
             mFilesystem->remove_dir_entry(dir->mStartCluster, position);
+            Shell::invalidate_path(path.string());
+        }
         else
             std::cout << path.filename().string() << " - no such directory" << std::endl;
 
@@ -158,7 +163,10 @@ void Shell::fill_handlers() {
         std::optional<DirEntry> fileToCat = Shell::get_dir_entry_from_path(args.front(), DirEntryType::FILE);
         if (!fileToCat) return true;
 
-        std::cout << mFilesystem->read_dir_entry_as_file(fileToCat.value()) << std::endl;
+        mFilesystem->read_dir_entry_as_file(fileToCat.value(), [](std::span<const char> chunk) {
+            std::cout.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        });
+        std::cout << std::endl;
         return true;
     };
     mHandlerMap["cd"] = [this](Arguments& args) -> bool {
@@ -170,28 +178,27 @@ void Shell::fill_handlers() {
         }
 
         DirEntry curDir = mFilesystem->get_dir_entry(mCWC, false, false);
-        auto dirEntries = mFilesystem->read_dir_entry_as_dir(curDir);
+        auto dentry = mFilesystem->find_dir_entry(args.front(), curDir);
+        if (!dentry) {
+            std::cout << args.front() << " - no such directory" << std::endl;
+            return true;
+        }
 
-        for (auto& dirEntry : dirEntries) {
-            if (Utils::remove_padding(dirEntry.mFilename) == args.front()) {
-                if (dirEntry.mIsFile) {
-                    std::cout << args.front() << " is a file" << std::endl;
-                    return true;
-                }
-                if (dirEntry.mStartCluster == 0)    // selected dirEntry is root "/"
-                    mCWD = "/";
-                else {
-                    auto dirTo = Utils::remove_padding(dirEntry.mFilename);
-                    dirTo = (mCWD == "/") ? dirTo : "/"s.append(dirTo);
-                    mCWD = (args.front() == "..")
-                           ? mCWD.substr(0, mCWD.find_last_of('/'))
-                           : mCWD += dirTo;
-                }
-                mCWC = dirEntry.mStartCluster;
-                return true;
-            }
+        const auto& dirEntry = dentry->dirEntry;
+        if (dirEntry.mIsFile) {
+            std::cout << args.front() << " is a file" << std::endl;
+            return true;
         }
-        std::cout << args.front() << " - no such directory" << std::endl;
+        if (dirEntry.mStartCluster == 0)    // selected dirEntry is root "/"
+            mCWD = "/";
+        else {
+            auto dirTo = Utils::remove_padding(dirEntry.mFilename);
+            dirTo = (mCWD == "/") ? dirTo : "/"s.append(dirTo);
+            mCWD = (args.front() == "..")
+                   ? mCWD.substr(0, mCWD.find_last_of('/'))
+                   : mCWD += dirTo;
+        }
+        mCWC = dirEntry.mStartCluster;
         return true;
     };
     mHandlerMap["pwd"] = [this](Arguments& args) -> bool {
@@ -231,16 +238,9 @@ void Shell::fill_handlers() {
         std::optional<DirEntry> targetDir = Shell::get_dir_entry_from_path(toPath.parent_path().string(), DirEntryType::DIR);
         if (!targetDir) return true;
 
-        // save file into string
-        std::stringstream ss;
-//        while (ifs.good()) {
-//            ss.put(ifs.get());
-//        }
-        ss << ifs.rdbuf();
-        const auto fileContent = ss.str();
-
-        // copy source file - no extra precautions
-        mFilesystem->create_dir_entry(targetDir->mStartCluster, toPath.filename().string(), true, fileContent);
+        // stream source file into disk - no extra precautions
+        auto fileSize = std::filesystem::file_size(fromPath);
+        mFilesystem->create_dir_entry(targetDir->mStartCluster, toPath.filename().string(), ifs, fileSize);
         return true;
     };
     mHandlerMap["outcp"] = [this](Arguments& args) -> bool {
@@ -262,9 +262,10 @@ void Shell::fill_handlers() {
             return true;
         }
 
-        // print file content into string
-        const auto fileContent = mFilesystem->read_dir_entry_as_file(fileToCopy.value());
-        ofs << fileContent;
+        // stream file content into target file, cluster by cluster
+        mFilesystem->read_dir_entry_as_file(fileToCopy.value(), [&ofs](std::span<const char> chunk) {
+            ofs.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+        });
 
         return true;
     };
@@ -317,6 +318,7 @@ void Shell::fill_handlers() {
                 continue;
             }
             mHandlerMap[opcode](args);
+            if (mFilesystem) mFilesystem->end_command();
         }
         return true;
     };
@@ -327,17 +329,51 @@ void Shell::fill_handlers() {
             return true;
         }
 
-        std::string arg(args[0]);
+        // optional cluster size, disk backend and FAT2, in any order
+        uint clusterSize = DEFAULT_CLUSTER_SIZE;
+        bool fatMirror = false;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "fat2") {
+                fatMirror = true;
+                continue;
+            }
+            if (std::regex_match(args[i], REGEX_FORMAT) || std::regex_match(args[i], REGEX_NUMBER)) {
+                clusterSize = Shell::parse_size(args[i]);
+                if (!Utils::is_valid_cluster_size(clusterSize)) {
+                    std::cout << "Invalid cluster size: " << args[i] << std::endl;
+                    std::cout << "Try a power of two from 512 to 1MB, e.g. 4KB" << std::endl;
+                    return true;
+                }
+                continue;
+            }
+
+            auto backend = Disk::parse_backend(args[i]);
+            if (!backend) {
+                std::cout << "Invalid disk backend: " << args[i] << std::endl;
+                std::cout << "Try: 'stream', 'mmap' or 'fat2'" << std::endl;
+                return true;
+            }
+            mBackend = backend.value();
+        }
+
+        auto diskSize = Shell::parse_size(args[0]);
+        if (diskSize / clusterSize < 2) {
+            std::cout << "Disk of " << args[0] << " is too small for clusters of " << clusterSize << " B" << std::endl;
+            return true;
+        }
+        // FAT and FAT2 are aligned to blocks, the padding has to fit as well
+        if (fatMirror && diskSize < 2 * Journal::BLOCK_SIZE + 2 * clusterSize) {
+            std::cout << "Disk of " << args[0] << " is too small for a second FAT" << std::endl;
+            return true;
+        }
+
         std::string_view msg = std::filesystem::exists(mFsName) ?
                           "Formatting existing disk..." : "Creating new disk...";
         std::cout << msg << std::endl;
-        mFilesystem = std::make_unique<Filesystem>(mFsName);
-
-        auto bytes = arg.substr(arg.length() - 2);
-        auto multiplier = std::regex_match(bytes, REGEX_KB) ? 1_KB : 1_MB;
-        auto diskSize = std::stoi(arg.substr(0, arg.size())) * multiplier;
+        mFilesystem = std::make_unique<Filesystem>(mFsName, mBackend);
 
-        mFilesystem->init(diskSize);
+        mFilesystem->init(diskSize, clusterSize, fatMirror);
+        Shell::clear_path_cache();
         mCWD = "/";
         mCWC = 0;
 
@@ -368,11 +404,8 @@ void Shell::fill_handlers() {
         std::optional<DirEntry> targetDir = Shell::get_dir_entry_from_path(toPath.parent_path().string(), DirEntryType::DIR);
         if (!targetDir) return true;
 
-        auto combinedContent = mFilesystem->read_dir_entry_as_file(fileToCopy1.value())
-                        .append(mFilesystem->read_dir_entry_as_file(fileToCopy2.value()));
-
         // create aggregate file - no extra precautions
-        mFilesystem->create_dir_entry(targetDir->mStartCluster, toPath.filename().string(), true, combinedContent);
+        mFilesystem->concat_dir_entries(targetDir->mStartCluster, fileToCopy1.value(), fileToCopy2.value(), toPath.filename().string());
         return true;
     };
     mHandlerMap["short"] = [this](Arguments& args) -> bool {
@@ -380,9 +413,9 @@ void Shell::fill_handlers() {
 
         // check if source file exists
         std::optional<DirEntry> fileToShort = Shell::get_dir_entry_from_path(path.string(), DirEntryType::BOTH);
-        auto name = Utils::remove_padding(fileToShort->mFilename);
-
         if (!fileToShort) return true;
+
+        auto name = Utils::remove_padding(fileToShort->mFilename);
         if (!fileToShort->mIsFile) {
             std::cout << name << " is a directory" << std::endl;
             return true;
@@ -394,15 +427,116 @@ void Shell::fill_handlers() {
 
         // get parent dir of shorted file - no need to check
         std::optional<DirEntry> dir = Shell::get_dir_entry_from_path(path.parent_path().string(), DirEntryType::DIR);
-        auto shortedContent = mFilesystem->read_dir_entry_as_file(fileToShort.value()).substr(0, SHORT_THRESHOLD);
 
-        // remove original file
-        auto pos = mFilesystem->get_position(name, dir.value());
-        mFilesystem->remove_dir_entry(dir->mStartCluster, pos);
+        // cut the file in place, only its tail is freed
+        mFilesystem->truncate(dir->mStartCluster, name, SHORT_THRESHOLD);
+        Shell::invalidate_path(path.string());
+
+        return true;
+    };
+    mHandlerMap["truncate"] = [this](Arguments& args) -> bool {
+        std::filesystem::path path(args.front());
+        if (!std::regex_match(args.back(), REGEX_NUMBER) && !std::regex_match(args.back(), REGEX_FORMAT)) {
+            std::cout << "Invalid size: " << args.back() << std::endl;
+            return true;
+        }
+
+        // check if target file exists
+        std::optional<DirEntry> fileToTruncate = Shell::get_dir_entry_from_path(path.string(), DirEntryType::FILE);
+        if (!fileToTruncate) return true;
+
+        // get parent dir of truncated file - no need to check
+        std::optional<DirEntry> dir = Shell::get_dir_entry_from_path(path.parent_path().string(), DirEntryType::DIR);
+        mFilesystem->truncate(dir->mStartCluster, path.filename().string(), Shell::parse_size(args.back()));
+        Shell::invalidate_path(path.string());     // cached DirEntry has the old size
+        return true;
+    };
+    mHandlerMap["append"] = [this](Arguments& args) -> bool {
+        std::filesystem::path path(args.front());
+
+        // check if target file exists
+        std::optional<DirEntry> fileToAppend = Shell::get_dir_entry_from_path(path.string(), DirEntryType::FILE);
+        if (!fileToAppend) return true;
 
-        // create original file with shorted content
-        mFilesystem->create_dir_entry(dir->mStartCluster, name, true, shortedContent);
+        // the rest of the arguments is the appended text
+        std::string text{args[1]};
+        for (size_t i = 2; i < args.size(); ++i) {
+            text.append(" ").append(args[i]);
+        }
+
+        // get parent dir of appended file - no need to check
+        std::optional<DirEntry> dir = Shell::get_dir_entry_from_path(path.parent_path().string(), DirEntryType::DIR);
+        mFilesystem->append(dir->mStartCluster, path.filename().string(), text);
+        Shell::invalidate_path(path.string());     // cached DirEntry has the old size
+        return true;
+    };
+    mHandlerMap["cache"] = [this](Arguments& args) -> bool {
+        if (!args.empty()) {
+            if (!std::regex_match(args.front(), REGEX_FORMAT) && !std::regex_match(args.front(), REGEX_NUMBER)) {
+                std::cout << "Invalid cache capacity: " << args.front() << " - use bytes, KB or MB, e.g. 4MB" << std::endl;
+                return true;
+            }
+            mFilesystem->set_cache_capacity(Shell::parse_size(args.front()));
+        }
 
+        const auto& cache = mFilesystem->cache();
+        std::cout << "Cached clusters: " << cache.size() << " (" << cache.size() * cache.cluster_size() << " B)"
+                  << ", capacity: " << cache.capacity() << " B" << std::endl;
+        std::cout << "Hits: " << cache.hits() << ", misses: " << cache.misses() << std::endl;
+        return true;
+    };
+    mHandlerMap["defrag"] = [this](Arguments& args) -> bool {
+        uint maxFiles = UINT_MAX;
+        if (!args.empty()) {
+            if (!std::regex_match(args.front(), REGEX_NUMBER)) {
+                std::cout << "Invalid file count: " << args.front() << std::endl;
+                return true;
+            }
+            maxFiles = std::stoul(args.front());
+        }
+
+        auto report = mFilesystem->defrag(maxFiles);
+        Shell::clear_path_cache();     // relocated files have new start clusters
+        std::cout << "Relocated file/s: " << report.relocatedFiles << ", directory/ies: " << report.relocatedDirs
+                  << ", moved bytes: " << report.bytesMoved << std::endl;
+        if (report.fragmentedFiles > 0 || report.fragmentedDirs > 0)
+            std::cout << "Fragmented file/s left: " << report.fragmentedFiles << ", directory/ies: " << report.fragmentedDirs << std::endl;
+        return true;
+    };
+    mHandlerMap["alloc"] = [this](Arguments& args) -> bool {
+        if (args.front() == "nextfit")
+            mFilesystem->set_allocation_mode(FAT::AllocationMode::NEXT_FIT);
+        else if (args.front() == "contiguous")
+            mFilesystem->set_allocation_mode(FAT::AllocationMode::CONTIGUOUS);
+        else
+            std::cout << "Invalid allocation mode: " << args.front() << " - use 'nextfit' or 'contiguous'" << std::endl;
+        return true;
+    };
+    mHandlerMap["sync"] = [this]([[maybe_unused]] Arguments& args) -> bool {
+        mFilesystem->sync();
+        return true;
+    };
+    mHandlerMap["writeback"] = [this](Arguments& args) -> bool {
+        if (!args.empty()) {
+            if (args.front() == "command")
+                mFilesystem->set_flush_policy(FlushPolicy::COMMAND);
+            else if (args.front() == "sync")
+                mFilesystem->set_flush_policy(FlushPolicy::SYNC);
+            else if (std::regex_match(args.front(), REGEX_NUMBER) && std::stoul(args.front()) > 0)
+                mFilesystem->set_flush_policy(FlushPolicy::INTERVAL, std::chrono::milliseconds{std::stoul(args.front())});
+            else {
+                std::cout << "Invalid flush policy: " << args.front() << " - use 'command', 'sync' or milliseconds" << std::endl;
+                return true;
+            }
+        }
+
+        auto& writeBack = mFilesystem->write_back();
+        switch (writeBack.policy()) {
+            case FlushPolicy::COMMAND: std::cout << "Flushing after every command"; break;
+            case FlushPolicy::INTERVAL: std::cout << "Flushing every " << writeBack.interval().count() << " ms"; break;
+            case FlushPolicy::SYNC: std::cout << "Flushing on sync only"; break;
+        }
+        std::cout << ", dirty clusters: " << writeBack.dirty_count() << std::endl;
         return true;
     };
     mHandlerMap["exit"] = [](Arguments& args) -> bool {
@@ -430,9 +564,16 @@ void Shell::fill_args_count() {
     mArgsCountMap["incp"] = Range{2, 2};
     mArgsCountMap["outcp"] = Range{2, 2};
     mArgsCountMap["load"] = Range{1, 1};
-    mArgsCountMap["format"] = Range{1, 1};
+    mArgsCountMap["format"] = Range{1, 4};
     mArgsCountMap["xcp"] = Range{3, 3};
     mArgsCountMap["short"] = Range{1, 1};
+    mArgsCountMap["truncate"] = Range{2, 2};
+    mArgsCountMap["append"] = Range{2, UINT_MAX};
+    mArgsCountMap["cache"] = Range{0, 1};
+    mArgsCountMap["defrag"] = Range{0, 1};
+    mArgsCountMap["alloc"] = Range{1, 1};
+    mArgsCountMap["sync"] = Range{0, 0};
+    mArgsCountMap["writeback"] = Range{0, 1};
     mArgsCountMap["exit"] = Range{0, 0};
     mArgsCountMap["quit"] = Range{0, 0};
     mArgsCountMap["close"] = Range{0, 0};
@@ -443,7 +584,95 @@ bool Shell::check_args_count(const std::string& opcode, uint argc) {
     return (range.lower <= argc && argc <= range.upper);
 }
 
+uint Shell::parse_size(const std::string& arg) {
+    if (std::regex_match(arg, REGEX_NUMBER)) return std::stoul(arg);
+
+    auto bytes = arg.substr(arg.length() - 2);
+    auto multiplier = std::regex_match(bytes, REGEX_KB) ? 1_KB : 1_MB;
+    return std::stoul(arg) * multiplier;
+}
+
+std::optional<std::string> Shell::path_cache_key(const std::string& path) const {
+    std::filesystem::path relativePath(path);
+
+    // '.' and '..' are resolved by the walk only, e.g. 'file/..' must fail
+    bool hasDots = std::any_of(relativePath.begin(), relativePath.end(), [](const std::filesystem::path& part) {
+        return part == "." || part == "..";
+    });
+    if (hasDots) return std::nullopt;
+
+    // a path without a name resolves to the '.' DirEntry of a directory, not to the one its parent holds
+    bool hasName = std::any_of(relativePath.begin(), relativePath.end(), [](const std::filesystem::path& part) {
+        return !part.empty() && part != "/";
+    });
+    if (!hasName) return std::nullopt;
+
+    auto key = (path.starts_with('/') ? relativePath : std::filesystem::path(mCWD) / relativePath).lexically_normal().string();
+    if (key.size() > 1 && key.ends_with('/')) key.pop_back();
+    return key;
+}
+
+std::map<std::string, Shell::CachedPath>::iterator Shell::erase_cached_path(std::map<std::string, CachedPath>::iterator it) {
+    mPathLru.erase(it->second.lru);
+    return mPathCache.erase(it);
+}
+
+void Shell::clear_path_cache() {
+    mPathCache.clear();
+    mPathLru.clear();
+}
+
+void Shell::invalidate_path(const std::string& path) {
+    auto key = Shell::path_cache_key(path);
+    if (!key) {     // cannot tell which subtree is affected
+        Shell::clear_path_cache();
+        return;
+    }
+
+    // drop the path itself and everything below it
+    auto self = mPathCache.find(key.value());
+    if (self != mPathCache.end()) Shell::erase_cached_path(self);
+    auto prefix = (key.value() == "/") ? key.value() : key.value() + "/";
+    auto it = mPathCache.lower_bound(prefix);
+    while (it != mPathCache.end() && it->first.starts_with(prefix)) {
+        it = Shell::erase_cached_path(it);
+    }
+}
+
 std::optional<DirEntry> Shell::get_dir_entry_from_path(const std::string& path, DirEntryType type) {
+    auto key = Shell::path_cache_key(path);
+    auto cached = key ? mPathCache.find(key.value()) : mPathCache.end();
+
+    DirEntry curDirEntry;
+    if (cached != mPathCache.end()) {
+        mPathLru.splice(mPathLru.begin(), mPathLru, cached->second.lru);
+        curDirEntry = cached->second.resolved.dirEntry;
+    }
+    else {
+        auto resolved = Shell::resolve_path(path);
+        if (!resolved) return std::nullopt;
+        curDirEntry = resolved->dirEntry;
+
+        if (key) {
+            // evict the least recently used path
+            if (mPathCache.size() >= PATH_CACHE_CAPACITY) Shell::erase_cached_path(mPathCache.find(mPathLru.back()));
+            mPathLru.push_front(key.value());
+            mPathCache[key.value()] = CachedPath{resolved.value(), mPathLru.begin()};
+        }
+    }
+
+    // found the correct dirEntry from path -> now check for filetype
+    if (type == DirEntryType::BOTH) return curDirEntry;
+    if (curDirEntry.mIsFile && type == DirEntryType::FILE) return curDirEntry;
+    if (!curDirEntry.mIsFile && type == DirEntryType::DIR) return curDirEntry;
+
+    auto str = (curDirEntry.mIsFile) ? "directory" : "file";   // reverse logic
+    std::cout << curDirEntry.mFilename << " is not a " << str << std::endl;
+
+    return std::nullopt;
+}
+
+std::optional<Shell::ResolvedPath> Shell::resolve_path(const std::string& path) {
     std::filesystem::path fullPath(path);
     std::vector<std::string> pathParts{};
 
@@ -461,6 +690,9 @@ std::optional<DirEntry> Shell::get_dir_entry_from_path(const std::string& path,
         parent = fullPath.parent_path().string();
     }
 
+    // parent of the starting point is its '..'
+    uint parentCluster = (pathParts.empty()) ? mFilesystem->find_dir_entry("..", curDirEntry)->dirEntry.mStartCluster : startCluster;
+
     // traverse from starting point and find next path part
     while (!pathParts.empty()) {
         // get path part
@@ -468,33 +700,23 @@ std::optional<DirEntry> Shell::get_dir_entry_from_path(const std::string& path,
         pathParts.pop_back();
 
         // searched current dir for dirEntry
-        auto dirEntries = mFilesystem->read_dir_entry_as_dir(curDirEntry);
-        auto searchedDirEntry = std::find_if(dirEntries.begin(), dirEntries.end(), [&pathPart](const DirEntry& dirEntry) {
-            return Utils::remove_padding(dirEntry.mFilename) == pathPart;
-        });
+        auto searchedDentry = mFilesystem->find_dir_entry(pathPart, curDirEntry);
 
         // current path part not found -> end prematurely
-        if (searchedDirEntry == std::end(dirEntries)) {
+        if (!searchedDentry) {
             std::cout << pathPart << " - not found" << std::endl;
             return std::nullopt;
         }
         // path part found -> keep going
-        curDirEntry = *searchedDirEntry;
+        parentCluster = curDirEntry.mStartCluster;
+        curDirEntry = searchedDentry->dirEntry;
     }
 
-    // found the correct dirEntry from path -> now check for filetype
-    if (type == DirEntryType::BOTH) return curDirEntry;
-    if (curDirEntry.mIsFile && type == DirEntryType::FILE) return curDirEntry;
-    if (!curDirEntry.mIsFile && type == DirEntryType::DIR) return curDirEntry;
-
-    auto str = (curDirEntry.mIsFile) ? "directory" : "file";   // reverse logic
-    std::cout << curDirEntry.mFilename << " is not a " << str << std::endl;
-
-    return std::nullopt;
+    return ResolvedPath{curDirEntry, parentCluster};
 }
 
 void Shell::mount(const std::string &fsName) {
-    mFilesystem = std::make_unique<Filesystem>(fsName);
+    mFilesystem = std::make_unique<Filesystem>(fsName, mBackend);
     mFilesystem->mount();
 }
 
@@ -539,5 +761,6 @@ void Shell::run(std::istream& istream) {
             continue;
         }
         ret = mHandlerMap[opcode](args);
+        if (mFilesystem) mFilesystem->end_command();
     }
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <map>
+#include <list>
 #include <memory>
 #include <vector>
 #include <optional>
@@ -21,12 +23,33 @@ class Shell {
          */
         enum class DirEntryType { DIR, FILE, BOTH };
 
+        /**
+         * Structure ResolvedPath - result of a path resolution.
+         */
+        struct ResolvedPath {
+            DirEntry dirEntry;
+            uint parentCluster;
+        };
+
+        /**
+         * Structure CachedPath - entry of the path cache.
+         */
+        struct CachedPath {
+            ResolvedPath resolved;
+            std::list<std::string>::iterator lru;   // position of the path in mPathLru
+        };
+
+        static constexpr size_t PATH_CACHE_CAPACITY = 1024;
+
         std::string mFsName;
+        DiskBackend mBackend;
         std::string mCWD;
         uint mCWC;    // current working cluster
         std::unique_ptr<Filesystem> mFilesystem;
         std::unordered_map<std::string, Handler> mHandlerMap;
         std::unordered_map<std::string, Range> mArgsCountMap;
+        std::map<std::string, CachedPath> mPathCache;       // normalised absolute path -> resolved path, ordered for subtrees
+        std::list<std::string> mPathLru;                    // cached paths, most recently used at the front
 
         /**
          * Method fills out the handler map with Handlers - functions.
@@ -54,14 +77,54 @@ class Shell {
 
         /**
          * Method parses the path to get the correct DirEntry. This method is the most important.
+         * Resolved paths are cached, so repeated lookups skip the directory walk.
          * @param path to traverse to find file
          * @param type pf file we want (file, dir, doesn't matter)
          * @return DirEntry corresponding to path or std::nullopt
          */
         std::optional<DirEntry> get_dir_entry_from_path(const std::string& path, DirEntryType type);
 
+        /**
+         * Method walks the directories of a path to find its DirEntry and parent cluster.
+         * @param path to traverse to find file
+         * @return resolved path or std::nullopt
+         */
+        std::optional<ResolvedPath> resolve_path(const std::string& path);
+
+        /**
+         * Method parses a size argument, e.g. "200KB", "4MB" or "512" (bytes).
+         * @param arg size matching REGEX_FORMAT or REGEX_NUMBER
+         * @return size in bytes
+         */
+        static uint parse_size(const std::string& arg);
+
+        /**
+         * Method normalises a path into an absolute path, used as a key of the path cache.
+         * @param path to be normalised
+         * @return normalised absolute path or std::nullopt if the path contains '.' or '..' or no name at all
+         */
+        [[nodiscard]] std::optional<std::string> path_cache_key(const std::string& path) const;
+
+        /**
+         * Method drops a path from the path cache.
+         * @param it path to be dropped
+         * @return iterator following the dropped path
+         */
+        std::map<std::string, CachedPath>::iterator erase_cached_path(std::map<std::string, CachedPath>::iterator it);
+
+        /**
+         * Method drops all paths from the path cache.
+         */
+        void clear_path_cache();
+
+        /**
+         * Method drops a path and its whole subtree from the path cache.
+         * @param path to be dropped
+         */
+        void invalidate_path(const std::string& path);
+
     public:
-        explicit Shell(const std::string& fsName);
+        explicit Shell(const std::string& fsName, DiskBackend backend = DiskBackend::STREAM);
         ~Shell() = default;
 
         /**
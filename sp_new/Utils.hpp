@@ -1,10 +1,14 @@
 #pragma once
 
+#include <bit>
 #include <string>
+#include <string_view>
+#include <algorithm>
 #include <vector>
 #include <iomanip>
 #include <sstream>
 #include <iostream>
+#include <type_traits>
 
 using uint = unsigned int;
 using uchar = unsigned char;
@@ -24,7 +28,9 @@ static constexpr uint operator"" _MB(unsigned long long int mb) {
     return mb * 1024_KB;
 }
 
-static constexpr uint CLUSTER_SIZE = 512_B;
+static constexpr uint DEFAULT_CLUSTER_SIZE = 512_B;
+static constexpr uint MIN_CLUSTER_SIZE = 512_B;
+static constexpr uint MAX_CLUSTER_SIZE = 1_MB;
 
 /**
  * Structure Range - with lower and upper bound.
@@ -41,98 +47,82 @@ struct Range {
 class Utils {
     public:
         /**
-         * Method calculates the sum size of all arguments.
-         * @tparam T types of arguments
-         * @param args arguments
-         * @return sum of all sizes of arguments
-         */
-        template<typename ... T>
-        static constexpr uint sum_sizeof(T ... args) {
-            return (0 + ... + sizeof(args));
-        }
-
-        /**
-         * Method writes any data to a stream.
-         * @tparam T type of data
-         * @param stream to be written to
-         * @param data to be written
-         */
-        template<typename T>
-        static void write_to_stream(std::iostream& stream, T& data) {
-            uint streamSize = sizeof(T);
-            stream.write(reinterpret_cast<char *>(&data), streamSize);
-        }
-
-        /**
-         * Variadic version of the previous method.
-         * @tparam T1 type of the first template arg
-         * @tparam T the rest of the template args
-         * @param stream to be written to
-         * @param data to be written
-         * @param args also data to be written
+         * Method returns a zero padded version of string.
+         * @param str string to be padded
+         * @param size of the resulting string, pad included
+         * @return
          */
-        template<typename  T1, typename ... T>
-        static void write_to_stream(std::iostream& stream, T1& data, T& ... args) {
-            write_to_stream(stream, data);
-            write_to_stream(stream, args ...);
+        static std::string zero_padded_string(const std::string &str, uint size) {
+            std::ostringstream stream;
+            stream << std::left << std::setw(size) << std::setfill('\0') << str ;
+            return stream.str();
         }
 
         /**
-         * Method reads any data from a stream.
-         * @tparam T data type to be returned
-         * @param stream to be read from
-         * @return the data of type T that was read from the stream
+         * Method returns a padded string without padding.
+         * @param str that was padded
+         * @return string with no padding
          */
-        template<typename T>
-        static T read_from_stream(std::iostream &stream) {
-            T data;
-            stream.read(reinterpret_cast<char *>(&data), sizeof(T));
-            return data;
+        static std::string remove_padding(const std::string& str) {
+            std::string result{str};
+            result.erase(std::remove(result.begin(), result.end(), '\0'), result.end());
+            return result;
         }
 
         /**
-         * Method writes a string to a stream.
-         * @param stream to be written to
-         * @param string to be written
+         * Method hashes a filename (32-bit FNV-1a). Directories place DirEntries by this hash,
+         * so it must stay the same across builds and platforms.
+         * @param name to be hashed
+         * @return hash of name
          */
-        static void string_to_stream(std::iostream &stream, const std::string &string) {
-            auto str = zero_padded_string(string, string.size());
-            stream.write(str.c_str(), string.size());
+        static uint hash_name(std::string_view name) {
+            uint hash = 2166136261u;
+            for (char c : name) {
+                hash ^= static_cast<uchar>(c);
+                hash *= 16777619u;
+            }
+            return hash;
         }
 
         /**
-         * Method reads a string from a stream.
-         * @param stream to be read from
-         * @param streamSize size of string to be read
-         * @return string of size streamSize from stream
+         * Method merges a sequence of cluster indices into runs of adjacent clusters.
+         * @param clusters sequence of cluster indices, e.g. a cluster chain
+         * @return runs of adjacent clusters in the order of the sequence
          */
-        static std::string string_from_stream(std::iostream &stream, uint streamSize) {
-            char temp[streamSize];
-            stream.read(temp, streamSize);
-            return std::string{temp, streamSize};
+        static std::vector<Range> to_runs(const std::vector<uint>& clusters) {
+            std::vector<Range> runs{};
+            for (auto cluster : clusters) {
+                if (!runs.empty() && runs.back().upper + 1 == cluster) runs.back().upper = cluster;
+                else runs.push_back(Range{cluster, cluster});
+            }
+            return runs;
         }
 
         /**
-         * Method returns a zero padded version of string.
-         * @param str string to be padded
-         * @param size of the resulting string, pad included
-         * @return
+         * Method checks if a cluster size is supported - a power of two between MIN and MAX_CLUSTER_SIZE.
+         * @param clusterSize to be checked
+         * @return true if supported, else false
          */
-        static std::string zero_padded_string(const std::string &str, uint size) {
-            std::ostringstream stream;
-            stream << std::left << std::setw(size) << std::setfill('\0') << str ;
-            return stream.str();
+        static constexpr bool is_valid_cluster_size(uint clusterSize) {
+            return std::has_single_bit(clusterSize) && clusterSize >= MIN_CLUSTER_SIZE && clusterSize <= MAX_CLUSTER_SIZE;
         }
 
         /**
-         * Method returns a padded string without padding.
-         * @param str that was padded
-         * @return string with no padding
+         * Method calls fn with the cluster size. Common sizes are passed as compile-time constants
+         * (std::integral_constant), so the per-cluster arithmetic and copies in fn get specialised for them.
+         * @tparam Fn callable taking the cluster size as auto
+         * @param clusterSize size of one cluster
+         * @param fn to be called
+         * @return result of fn
          */
-        static std::string remove_padding(const std::string& str) {
-            std::string result{str};
-            result.erase(std::remove(result.begin(), result.end(), '\0'), result.end());
-            return result;
+        template<typename Fn>
+        static decltype(auto) with_cluster_size(uint clusterSize, Fn&& fn) {
+            switch (clusterSize) {
+                case 512_B: return fn(std::integral_constant<uint, 512_B>{});
+                case 4_KB: return fn(std::integral_constant<uint, 4_KB>{});
+                case 64_KB: return fn(std::integral_constant<uint, 64_KB>{});
+                default: return fn(clusterSize);
+            }
         }
 
         /**
@@ -0,0 +1,9 @@
+# Regression check of the path cache - an empty path resolved from the CWD (parent of 'x' below) must not
+# be cached as the '.' DirEntry of the directory, 'mv d e' used to fail with "Cannot move ." then.
+file(REMOVE path_cache.img)
+file(WRITE path_cache.in "format 1MB\nmkdir d\ncd d\nincp path_cache.in x\ncd /\nmv d e\nls\nls e\nexit\n")
+execute_process(COMMAND ${SP_NEW} path_cache.img INPUT_FILE path_cache.in OUTPUT_VARIABLE output RESULT_VARIABLE result)
+
+if (NOT result EQUAL 0 OR output MATCHES "Cannot move" OR NOT output MATCHES "\n\\.\\./\ne/\n" OR NOT output MATCHES "\n\\.\\./\nx\n")
+    message(FATAL_ERROR "'mv d e' after 'incp' in d failed:\n${output}")
+endif ()